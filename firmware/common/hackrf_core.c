@@ -288,6 +288,8 @@ void pin_setup(void) {
 	scu_pinmux(SCU_ADF_TXDATA, SCU_GPIO_NOPULL);
 	scu_pinmux(SCU_ADF_CE, SCU_GPIO_FAST);
 	scu_pinmux(SCU_ADF_LE, SCU_GPIO_FAST);
+	/* Trigger input, active high, idle low when nothing is connected */
+	scu_pinmux(SCU_GPIO0, SCU_GPIO_PDN | SCU_CONF_FUNCTION0);
 
     /* Configure P2_3 as USB0_PPWR */
 	//scu_pinmux(SCU_OTG_USBV, SCU_CONF_FUNCTION7);
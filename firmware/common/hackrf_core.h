@@ -155,6 +155,8 @@ extern "C"
 #define PIN_BOOT1   (BIT9)  /* GPIO0[9] on P1_2 */
 #define PIN_BOOT2   (BIT7)  /* GPIO5[7] on P2_8 */
 #define PIN_BOOT3   (BIT10) /* GPIO1[10] on P2_9 */
+#define PIN_TRIGGER  (BIT11) /* GPIO1[11] on P2_11, external capture trigger */
+#define PORT_TRIGGER (GPIO1)
 
 /* Read GPIO Pin */
 #define GPIO_STATE(port, pin) ((GPIO_PIN(port) & (pin)) == (pin))
@@ -162,6 +164,7 @@ extern "C"
 #define BOOT1_STATE       GPIO_STATE(GPIO0, PIN_BOOT1)
 #define BOOT2_STATE       GPIO_STATE(GPIO5, PIN_BOOT2)
 #define BOOT3_STATE       GPIO_STATE(GPIO1, PIN_BOOT3)
+#define TRIGGER_STATE     GPIO_STATE(PORT_TRIGGER, PIN_TRIGGER)
 #define MIXER_SDATA_STATE GPIO_STATE(PORT_MIXER_SDATA, PIN_MIXER_SDATA)
 #define CPLD_TDO_STATE    GPIO_STATE(PORT_CPLD_TDO, PIN_CPLD_TDO)
 
@@ -171,6 +174,20 @@ typedef enum {
 	TRANSCEIVER_MODE_TX = 2
 } transceiver_mode_t;
 
+typedef enum {
+	CAPTURE_MODE_ISR = 0,
+	CAPTURE_MODE_DMA = 1,
+	CAPTURE_MODE_M0 = 2
+} capture_mode_t;
+
+typedef enum {
+	STREAM_FORMAT_RAW = 0,
+	STREAM_FORMAT_INT16 = 1,
+	STREAM_FORMAT_PACKED10 = 2,
+	STREAM_FORMAT_RAW40 = 3,
+	STREAM_FORMAT_RANGE = 4
+} stream_format_t;
+
 void delay(uint32_t duration);
 
 void cpu_clock_init(void);
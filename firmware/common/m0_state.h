@@ -0,0 +1,38 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __M0_STATE_H__
+#define __M0_STATE_H__
+
+#include <stdint.h>
+
+/* State written by the M0 capture image and read by the M4. Address of
+ * m0_state is set in ldscripts to the start of ram_shared, which both cores
+ * see at the same address.
+ */
+typedef struct {
+	volatile uint8_t* segment_state;	/* usb_bulk_segment_state, set by the M4 */
+	volatile uint32_t interrupts;	/* SGPIO interrupts taken */
+	volatile uint32_t packets;	/* SGPIO exchanges seen, including dropped ones */
+	volatile uint32_t overruns;	/* Packets dropped while stalled */
+} m0_state_t;
+
+extern m0_state_t m0_state;
+
+#endif/*__M0_STATE_H__*/
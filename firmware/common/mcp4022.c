@@ -90,7 +90,11 @@ void mcp_set(uint8_t val) {
     if (diff > 0) {
         mcp_inc(diff);
     } else if (diff < 0) {
-        mcp_dec(diff);
+        mcp_dec(-diff);
     }
     mcp_val = val;
 }
+
+uint8_t mcp_get(void) {
+    return mcp_val;
+}
@@ -6,6 +6,7 @@
 
 void mcp_init(void);
 void mcp_set(uint8_t val);
+uint8_t mcp_get(void);
 
 
 #endif
@@ -2,6 +2,7 @@
 #include <libopencm3/lpc43xx/scu.h>
 #include <libopencm3/lpc43xx/ssp.h>
 #include "hackrf_core.h"
+#include "rf_path.h"
 
 void enable_pa(void) {
     gpio_set(PORT_PA_OFF, PIN_PA_OFF);
@@ -60,6 +61,24 @@ void adf4158_write_register(uint32_t data) {
     gpio_set(PORT_ADF_LE, PIN_ADF_LE);
 }
 
+/* Writes a full register image in the order the datasheet requires:
+ * R7 first, R6 and R5 twice each (once per step/deviation word select)
+ * and R0 last, which double-buffers the new ramp into the synthesizer.
+ * The control bits in the low three bits of each word are filled in here.
+ */
+void adf4158_write_image(const uint32_t* const regs) {
+    int reg;
+
+    adf4158_write_register((regs[7] & ~ADF4158_CONTROL_MASK) | 7);
+    adf4158_write_register((regs[6] & ~(ADF4158_CONTROL_MASK | ADF4158_WORD_SEL)) | 6);
+    adf4158_write_register((regs[6] & ~ADF4158_CONTROL_MASK) | ADF4158_WORD_SEL | 6);
+    adf4158_write_register((regs[5] & ~(ADF4158_CONTROL_MASK | ADF4158_WORD_SEL)) | 5);
+    adf4158_write_register((regs[5] & ~ADF4158_CONTROL_MASK) | ADF4158_WORD_SEL | 5);
+    for(reg=4;reg>=0;reg--) {
+        adf4158_write_register((regs[reg] & ~ADF4158_CONTROL_MASK) | reg);
+    }
+}
+
 uint32_t adf4158_read_register(void) {
     uint32_t read = 0;
 
@@ -17,7 +17,13 @@ void disable_adf4158(void);
 void rf_disable(void);
 void rf_enable(void);
 
+#define ADF4158_REGISTERS 8
+#define ADF4158_CONTROL_MASK 0x7
+/* step_sel in R6 and dev_sel in R5 */
+#define ADF4158_WORD_SEL (1 << 23)
+
 void adf4158_write_register(uint32_t data);
+void adf4158_write_image(const uint32_t* const regs);
 uint32_t adf4158_read_register(void);
 
 #endif
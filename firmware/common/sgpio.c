@@ -51,9 +51,9 @@ void sgpio_configure_pin_functions() {
     */
     // Same as SCU_GPIO_FAST, but pullup is enabled
 	scu_pinmux(SCU_PINMUX_SGPIO14, (SCU_CONF_EHS_FAST | SCU_CONF_EZI_EN_IN_BUFFER | SCU_CONF_ZIF_DIS_IN_GLITCH_FILT) | SCU_CONF_FUNCTION6);
-    /*
-	scu_pinmux(SCU_PINMUX_SGPIO15, SCU_GPIO_FAST | SCU_CONF_FUNCTION6);
-    */
+    // SGPIO15 only carries the GPDMA request. Its pad (P1_5, not connected)
+    // stays on GPIO1[8], an input, so the request never leaves the chip.
+	scu_pinmux(SCU_PINMUX_SGPIO15, SCU_GPIO_PDN | SCU_CONF_FUNCTION0);
 
 	//GPIO_DIR(GPIO0) |= GPIOPIN13;
 	//GPIO_DIR(GPIO5) |= GPIOPIN14 | GPIOPIN13 | GPIOPIN12;
@@ -348,6 +348,47 @@ void sgpio_configure(void) {
 
     slice_enable_mask |= (1 << SGPIO_SLICE_N);
 
+    // SGPIO15/SLICE P: GPDMA request, one pulse per slice exchange.
+    // Enabled by baseband_streaming_dma_enable().
+    SGPIO_MUX_CFG(SGPIO_SLICE_P) =
+      SGPIO_MUX_CFG_CONCAT_ORDER(0) /* Self-loop */
+    | SGPIO_MUX_CFG_CONCAT_ENABLE(1)
+    | SGPIO_MUX_CFG_QUALIFIER_SLICE_MODE(0) /* Select qualifier slice A(0x0) */
+    | SGPIO_MUX_CFG_QUALIFIER_PIN_MODE(1) /* Select qualifier pin SGPIO9(0x1) */
+    | SGPIO_MUX_CFG_QUALIFIER_MODE(0) /* Enable */
+    | SGPIO_MUX_CFG_CLK_SOURCE_SLICE_MODE(0) /* Select clock source slice D(0x0) */
+    | SGPIO_MUX_CFG_CLK_SOURCE_PIN_MODE(0) /* Source Clock Pin 0x0 = SGPIO8 */
+    | SGPIO_MUX_CFG_EXT_CLK_ENABLE(1) /* External clock signal(pin) selected */
+    ;
+
+    SGPIO_SLICE_MUX_CFG(SGPIO_SLICE_P) =
+          SGPIO_SLICE_MUX_CFG_INV_QUALIFIER(0) /* 0x0=Use normal qualifier. */
+        | SGPIO_SLICE_MUX_CFG_PARALLEL_MODE(0) /* 0x0=Shift 1 bit per clock. */
+        | SGPIO_SLICE_MUX_CFG_DATA_CAPTURE_MODE(0) /* 0x0=Detect rising edge. (Condition for input bit match interrupt) */
+        | SGPIO_SLICE_MUX_CFG_INV_OUT_CLK(0) /* 0x0=Normal clock. */
+        | SGPIO_SLICE_MUX_CFG_CLKGEN_MODE(1) /* 0x1=Use external clock from a pin or other slice */
+        | SGPIO_SLICE_MUX_CFG_CLK_CAPTURE_MODE(clk_capture_mode) /* 0x0=Use rising clock edge, 0x1=Use falling clock edge */
+        | SGPIO_SLICE_MUX_CFG_MATCH_MODE(0) /* 0x0=Do not match data */
+        ;
+
+    SGPIO_PRESET(SGPIO_SLICE_P) = 0x00;
+    SGPIO_COUNT(SGPIO_SLICE_P) = 0x00;
+    SGPIO_POS(SGPIO_SLICE_P) =
+          SGPIO_POS_POS_RESET(0x1f)
+        | SGPIO_POS_POS(0x1f)
+    ;
+
+    SGPIO_REG(SGPIO_SLICE_P) = 0x00000001;     // Primary output data register, LSB -> out
+    SGPIO_REG_SS(SGPIO_SLICE_P) = 0x00000001;  // Shadow output data register, LSB -> out1
+
+    SGPIO_OUT_MUX_CFG(15) =     // SGPIO15: GPDMA request output
+          SGPIO_OUT_MUX_CFG_P_OE_CFG(0) /* 0x0 gpio_oe (state set by GPIO_OEREG) */
+        | SGPIO_OUT_MUX_CFG_P_OUT_CFG(0) /* 0x0 dout_doutm1 (1-bit mode) */
+        ;
+    // The DMA request follows the output enable, so it has to be set. The
+    // pad isn't muxed to SGPIO15 (see sgpio_configure_pin_functions()).
+    SGPIO_GPIO_OENREG |= (1L << 15);
+
 	// Start SGPIO operation by enabling slice clocks.
 	SGPIO_CTRL_ENABLE = slice_enable_mask;
 }
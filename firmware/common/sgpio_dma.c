@@ -0,0 +1,122 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <sgpio_dma.h>
+
+#include <libopencm3/lpc43xx/creg.h>
+#include <libopencm3/lpc43xx/gpdma.h>
+#include <libopencm3/lpc43xx/sgpio.h>
+
+#include <gpdma.h>
+
+static const uint_fast8_t dma_channel_sgpio = 0;
+
+/* Slice P shifts a single one out on SGPIO15 once per slice exchange. SGPIO14
+ * can't be used for the request as it's the ADF4158 MUXOUT input. */
+static const uint_fast8_t dma_peripheral_sgpio = 15;
+
+void sgpio_dma_configure_lli(
+	gpdma_lli_t* const lli,
+	const size_t lli_count,
+	void* const buffer,
+	const size_t transfer_bytes
+) {
+	const size_t bytes_per_word = 4;
+	const size_t transfer_words = (transfer_bytes + bytes_per_word - 1) / bytes_per_word;
+
+	gpdma_lli_create_loop(lli, lli_count);
+
+	for(size_t i=0; i<lli_count; i++) {
+		/* Every LLI restarts from the first shadow register and copies
+		 * consecutive slices, one burst per DMA request. */
+		lli[i].csrcaddr = (void*)&SGPIO_REG_SS(0);
+		lli[i].cdestaddr = (uint8_t*)buffer + (transfer_words * bytes_per_word * i);
+		lli[i].clli = (lli[i].clli & ~GPDMA_CLLI_LM_MASK) | GPDMA_CLLI_LM(1);
+		lli[i].ccontrol =
+			  GPDMA_CCONTROL_TRANSFERSIZE(transfer_words)
+			| GPDMA_CCONTROL_SBSIZE(3) /* 16 transfers per burst */
+			| GPDMA_CCONTROL_DBSIZE(3)
+			| GPDMA_CCONTROL_SWIDTH(2) /* 32-bit */
+			| GPDMA_CCONTROL_DWIDTH(2)
+			| GPDMA_CCONTROL_S(0) /* SGPIO on AHB master 0 */
+			| GPDMA_CCONTROL_D(1) /* SRAM on AHB master 1 */
+			| GPDMA_CCONTROL_SI(1)
+			| GPDMA_CCONTROL_DI(1)
+			| GPDMA_CCONTROL_PROT1(0)
+			| GPDMA_CCONTROL_PROT2(0)
+			| GPDMA_CCONTROL_PROT3(0)
+			| GPDMA_CCONTROL_I(0)
+			;
+	}
+}
+
+void sgpio_dma_init(void) {
+	/* DMA peripheral 15, option 2 = SGPIO15 */
+	CREG_DMAMUX &= ~CREG_DMAMUX_DMAMUXPER15_MASK;
+	CREG_DMAMUX |= CREG_DMAMUX_DMAMUXPER15(0x2);
+
+	gpdma_controller_enable();
+}
+
+void sgpio_dma_rx_start(const gpdma_lli_t* const start_lli) {
+	sgpio_dma_stop();
+
+	GPDMA_CSRCADDR(dma_channel_sgpio) = (uint32_t)start_lli->csrcaddr;
+	GPDMA_CDESTADDR(dma_channel_sgpio) = (uint32_t)start_lli->cdestaddr;
+	GPDMA_CLLI(dma_channel_sgpio) = start_lli->clli;
+	GPDMA_CCONTROL(dma_channel_sgpio) = start_lli->ccontrol;
+
+	GPDMA_CCONFIG(dma_channel_sgpio) =
+		  GPDMA_CCONFIG_E(0)
+		| GPDMA_CCONFIG_SRCPERIPHERAL(dma_peripheral_sgpio)
+		| GPDMA_CCONFIG_DESTPERIPHERAL(0)
+		| GPDMA_CCONFIG_FLOWCNTRL(2) /* Peripheral to memory, DMA controlled */
+		| GPDMA_CCONFIG_IE(1)
+		| GPDMA_CCONFIG_ITC(1)
+		| GPDMA_CCONFIG_L(0)
+		| GPDMA_CCONFIG_H(0)
+		;
+
+	gpdma_channel_interrupt_tc_clear(dma_channel_sgpio);
+	gpdma_channel_interrupt_error_clear(dma_channel_sgpio);
+	gpdma_channel_enable(dma_channel_sgpio);
+}
+
+void sgpio_dma_stop(void) {
+	gpdma_channel_disable(dma_channel_sgpio);
+	gpdma_channel_interrupt_tc_clear(dma_channel_sgpio);
+	gpdma_channel_interrupt_error_clear(dma_channel_sgpio);
+}
+
+void sgpio_dma_irq_tc_acknowledge(void) {
+	gpdma_channel_interrupt_tc_clear(dma_channel_sgpio);
+}
+
+/* True if the channel stopped on a bus error, which is cleared */
+bool sgpio_dma_irq_error_acknowledge(void) {
+	if( !(GPDMA_INTERRSTAT & (1 << dma_channel_sgpio)) ) {
+		return false;
+	}
+	gpdma_channel_interrupt_error_clear(dma_channel_sgpio);
+	return true;
+}
+
+void* sgpio_dma_current_destination(void) {
+	return (void*)GPDMA_CDESTADDR(dma_channel_sgpio);
+}
@@ -22,10 +22,17 @@
 
 #include <streaming.h>
 
+#include <string.h>
+
 #include <libopencm3/lpc43xx/m4/nvic.h>
+#include <libopencm3/lpc43xx/ipc.h>
 #include <libopencm3/lpc43xx/sgpio.h>
 
 #include <sgpio.h>
+#include <sgpio_dma.h>
+
+/* Set in ldscripts, see LPC43xx_M4_M0_image_from_text.ld */
+extern uint8_t __m0_start__, __m0_end__, __ram_m0_start__;
 
 void baseband_streaming_enable() {
 	nvic_set_priority(NVIC_SGPIO_IRQ, 0);
@@ -35,8 +42,33 @@ void baseband_streaming_enable() {
 	SGPIO_CTRL_ENABLE |= (1 << SGPIO_SLICE_M);
 }
 
+void baseband_streaming_m0_enable() {
+	/* M0 is held in reset here, load a fresh copy of its image */
+	memcpy(&__ram_m0_start__, &__m0_start__, &__m0_end__ - &__m0_start__);
+
+	nvic_set_priority(NVIC_M0CORE_IRQ, 0);
+	nvic_enable_irq(NVIC_M0CORE_IRQ);
+	ipc_start_m0((uint32_t)&__ram_m0_start__);
+
+	SGPIO_SET_EN_1 = (1 << SGPIO_SLICE_A);
+
+	SGPIO_CTRL_ENABLE |= (1 << SGPIO_SLICE_M);
+}
+
+void baseband_streaming_dma_enable(const gpdma_lli_t* const lli) {
+	sgpio_dma_rx_start(lli);
+	nvic_set_priority(NVIC_DMA_IRQ, 0);
+	nvic_enable_irq(NVIC_DMA_IRQ);
+
+	SGPIO_CTRL_ENABLE |= (1 << SGPIO_SLICE_P) | (1 << SGPIO_SLICE_M);
+}
+
 void baseband_streaming_disable() {
-	SGPIO_CTRL_ENABLE &= ~(1 << SGPIO_SLICE_M);
+	SGPIO_CTRL_ENABLE &= ~((1 << SGPIO_SLICE_M) | (1 << SGPIO_SLICE_P));
 
 	nvic_disable_irq(NVIC_SGPIO_IRQ);
+	nvic_disable_irq(NVIC_DMA_IRQ);
+	nvic_disable_irq(NVIC_M0CORE_IRQ);
+	sgpio_dma_stop();
+	ipc_halt_m0();
 }
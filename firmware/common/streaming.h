@@ -23,7 +23,11 @@
 #ifndef __STREAMING_H__
 #define __STREAMING_H__
 
+#include <libopencm3/lpc43xx/gpdma.h>
+
 void baseband_streaming_enable();
+void baseband_streaming_m0_enable();
+void baseband_streaming_dma_enable(const gpdma_lli_t* const lli);
 void baseband_streaming_disable();
 
 #endif/*__STREAMING_H__*/
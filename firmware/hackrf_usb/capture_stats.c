@@ -0,0 +1,67 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "capture_stats.h"
+
+#include "m0_state.h"
+
+volatile capture_stats_t capture_stats;
+volatile uint32_t capture_stats_isr_last = 0;
+static bool capture_stats_m0 = false;
+
+/* Start the DWT cycle counter used to time capture interrupts */
+void capture_stats_init(void) {
+	SCS_DEMCR |= SCS_DEMCR_TRCENA;
+	SCS_DWT_CYCCNT = 0;
+	SCS_DWT_CTRL |= SCS_DWT_CTRL_CYCCNTENA;
+	capture_stats_reset(false);
+}
+
+/* Only call with capture stopped, m0 tells whether the M0 image captures */
+void capture_stats_reset(const bool m0) {
+	capture_stats_m0 = m0;
+	capture_stats.interrupts = 0;
+	capture_stats.packets = 0;
+	capture_stats.overruns = 0;
+	capture_stats.transfers = 0;
+	capture_stats.sync_edges = 0;
+	capture_stats.isr_cycles_max = 0;
+	capture_stats.isr_interval_max = 0;
+	capture_stats.dma_errors = 0;
+	capture_stats_isr_last = 0;
+	m0_state.interrupts = 0;
+	m0_state.packets = 0;
+	m0_state.overruns = 0;
+}
+
+/* Snapshot including the M0 capture counters. The M0 has no cycle counter,
+ * so the timing fields only cover the M4 capture modes, and the M4 never
+ * sees the sync words of packets the M0 captures.
+ */
+void capture_stats_read(capture_stats_t* const stats) {
+	stats->interrupts = capture_stats.interrupts + m0_state.interrupts;
+	stats->packets = capture_stats.packets + m0_state.packets;
+	stats->overruns = capture_stats.overruns + m0_state.overruns;
+	stats->transfers = capture_stats.transfers;
+	stats->sync_edges = capture_stats_m0 ? CAPTURE_STATS_UNAVAILABLE : capture_stats.sync_edges;
+	stats->isr_cycles_max = capture_stats.isr_cycles_max;
+	stats->isr_interval_max = capture_stats.isr_interval_max;
+	stats->dma_errors = capture_stats.dma_errors;
+}
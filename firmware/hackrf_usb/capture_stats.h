@@ -0,0 +1,76 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __CAPTURE_STATS_H__
+#define __CAPTURE_STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/memorymap.h>
+#include <libopencm3/cm3/scs.h>
+
+/* Capture telemetry, reset when RX starts and read by the host with
+ * usb_vendor_request_read_stats(). All fields are sent little endian in
+ * this order.
+ */
+typedef struct {
+	uint32_t interrupts;	/* Capture interrupts taken */
+	uint32_t packets;	/* SGPIO exchanges seen, including dropped ones */
+	uint32_t overruns;	/* Packets dropped while usb_bulk_buffer was full */
+	uint32_t transfers;	/* Segments sent over USB */
+	uint32_t sync_edges;	/* Falling sync edges, dropped packets included, or
+				 * CAPTURE_STATS_UNAVAILABLE when the M0 captures */
+	uint32_t isr_cycles_max;	/* Longest capture interrupt, in M4 cycles */
+	uint32_t isr_interval_max;	/* Longest time between two capture interrupts */
+	uint32_t dma_errors;	/* GPDMA bus errors, capture restarted after each */
+} capture_stats_t;
+
+/* Value of a field the capture mode can't provide */
+#define CAPTURE_STATS_UNAVAILABLE (0xFFFFFFFF)
+
+extern volatile capture_stats_t capture_stats;
+extern volatile uint32_t capture_stats_isr_last;
+
+void capture_stats_init(void);
+void capture_stats_reset(const bool m0);
+void capture_stats_read(capture_stats_t* const stats);
+
+/* Called at the end of a capture interrupt with the DWT cycle count read on
+ * entry. The interval only grows past the nominal interrupt period when an
+ * interrupt was held off, which shows the worst latency to servicing SGPIO.
+ */
+static inline void capture_stats_isr(const uint32_t entry) {
+	const uint32_t cycles = SCS_DWT_CYCCNT - entry;
+	if( cycles > capture_stats.isr_cycles_max ) {
+		capture_stats.isr_cycles_max = cycles;
+	}
+
+	if( capture_stats_isr_last ) {
+		const uint32_t interval = entry - capture_stats_isr_last;
+		if( interval > capture_stats.isr_interval_max ) {
+			capture_stats.isr_interval_max = interval;
+		}
+	}
+	capture_stats_isr_last = entry | 1;
+}
+
+#endif/*__CAPTURE_STATS_H__*/
@@ -0,0 +1,180 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "gain_control.h"
+
+#include <libopencm3/lpc43xx/m4/nvic.h>
+
+#include "mcp4022.h"
+#include "stream_format.h"
+
+typedef enum {
+	STEP_IDLE = 0,
+	STEP_DUE = 1,		/* Main loop writes the next gain */
+	STEP_WRITTEN = 2	/* Next gain starts at the next falling edge */
+} step_state_t;
+
+static gain_control_config_t pending;
+static gain_control_config_t config;
+static bool running;
+
+static volatile uint8_t state = STEP_IDLE;
+static volatile uint8_t active;
+static volatile uint8_t next;
+// A step took effect in the segment being filled
+static volatile bool landed;
+
+// Statistics of the sweep in progress, in D9 - D2 magnitudes
+static bool sweep_started;
+static uint_fast8_t clip_code;
+static uint_fast8_t low_code;
+static uint_fast8_t sweep_peak;
+static uint32_t sweep_clipped;
+static uint32_t weak_sweeps;
+
+/* Stored for the next capture, false if the range or step is invalid */
+bool gain_control_configure(const gain_control_config_t* const new_config) {
+	if( new_config->enable
+	    && ((new_config->gain_min > new_config->gain_max)
+	        || (new_config->gain_max > MCP_MAX_VALUE)
+	        || (new_config->step == 0)) ) {
+		return false;
+	}
+	pending = *new_config;
+	return true;
+}
+
+/* Called whenever capture starts or stops, sweeps tells whether capture
+ * calls gain_control_packet() and gain_control_edge(). Stopping capture
+ * turns the loop off until it is configured again. */
+void gain_control_reset(const bool sweeps) {
+	if( !sweeps ) {
+		pending.enable = 0;
+	}
+	config = pending;
+	running = sweeps && config.enable;
+
+	state = STEP_IDLE;
+	active = mcp_get();
+	landed = false;
+	sweep_started = false;
+	sweep_peak = 0;
+	sweep_clipped = 0;
+	weak_sweeps = 0;
+
+	// Magnitudes of D9 - D2 reach 127 for both full scale codes
+	clip_code = ((config.clip_level >> 2) < 127) ? (config.clip_level >> 2) : 127;
+	low_code = ((config.low_level >> 2) < 127) ? (config.low_level >> 2) : 127;
+}
+
+bool gain_control_running(void) {
+	return running;
+}
+
+void gain_control_packet(const uint32_t* const p) {
+	if( !running ) {
+		return;
+	}
+
+	const int8_t* const d9_d2 = (const int8_t*)p;
+	uint_fast8_t peak = sweep_peak;
+	uint32_t clipped = sweep_clipped;
+	for(uint_fast8_t j=0; j<STREAM_SAMPLES_PER_PACKET; j++) {
+		const uint_fast8_t m = (uint8_t)(d9_d2[j] ^ (d9_d2[j] >> 7));
+		if( m > peak ) {
+			peak = m;
+		}
+		if( m >= clip_code ) {
+			clipped++;
+		}
+	}
+	sweep_peak = peak;
+	sweep_clipped = clipped;
+}
+
+/* Called by capture for every falling sync edge, true when a step takes
+ * effect at this edge */
+bool gain_control_edge(void) {
+	if( !running ) {
+		return false;
+	}
+
+	const uint_fast8_t peak = sweep_peak;
+	const uint32_t clipped = sweep_clipped;
+	sweep_peak = 0;
+	sweep_clipped = 0;
+
+	if( state == STEP_WRITTEN ) {
+		// The sweep that ended was transitional, don't judge it
+		active = next;
+		state = STEP_IDLE;
+		landed = true;
+		weak_sweeps = 0;
+		return true;
+	}
+	// Nothing before the first edge is a whole sweep
+	if( !sweep_started ) {
+		sweep_started = true;
+		return false;
+	}
+	if( state != STEP_IDLE ) {
+		return false;
+	}
+
+	if( clipped > config.clip_limit ) {
+		weak_sweeps = 0;
+		if( active > config.gain_min ) {
+			next = (active - config.gain_min > config.step) ? active - config.step : config.gain_min;
+			state = STEP_DUE;
+		}
+	} else if( peak < low_code ) {
+		if( (++weak_sweeps >= config.hold) && (active < config.gain_max) ) {
+			weak_sweeps = 0;
+			next = (config.gain_max - active > config.step) ? active + config.step : config.gain_max;
+			state = STEP_DUE;
+		}
+	} else {
+		weak_sweeps = 0;
+	}
+	return false;
+}
+
+/* Called by capture when it closed a segment */
+void gain_control_segment_closed(void) {
+	landed = false;
+}
+
+/* Gain of the sweep in progress */
+uint_fast8_t gain_control_active(void) {
+	return running ? active : mcp_get();
+}
+
+/* Write a pending step to the MCP4022, called from the main loop */
+void gain_control_process(void) {
+	if( (state != STEP_DUE) || landed ) {
+		return;
+	}
+
+	// Vendor requests drive the MCP4022 from the USB interrupt as well
+	nvic_disable_irq(NVIC_USB0_IRQ);
+	mcp_set(next);
+	state = STEP_WRITTEN;
+	nvic_enable_irq(NVIC_USB0_IRQ);
+}
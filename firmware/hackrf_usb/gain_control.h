@@ -0,0 +1,66 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __GAIN_CONTROL_H__
+#define __GAIN_CONTROL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Closed loop gain through the MCP4022, from the peak and clipping
+ * statistics of every sweep in the framed sample formats.
+ *
+ * Capture passes each packet to gain_control_packet() before its sync
+ * edges, so a packet counts towards the sweep that ends in it. At a falling
+ * edge the sweep that ended decides on at most one step: down when more
+ * than clip_limit samples reached clip_level, up when the peak stayed below
+ * low_level for hold sweeps in a row. Levels are compared at the resolution
+ * of D9 - D2.
+ *
+ * Like a sweep profile switch, the main loop steps the MCP4022 during the
+ * following sweep, which is transitional, and the new gain is in effect from
+ * the next falling edge on. Segments record the edge a step took effect at,
+ * and the next step is only written once the segment holding the previous
+ * one was closed.
+ */
+
+/* Sent by the host little endian in this order, taking effect when capture
+ * starts and lasting until it is turned off */
+typedef struct {
+	uint8_t enable;
+	uint8_t gain_min;	/* MCP4022 range the loop stays in */
+	uint8_t gain_max;
+	uint8_t step;	/* MCP4022 steps per change */
+	uint16_t clip_level;	/* Magnitude counted as clipped, full scale is 512 */
+	uint16_t clip_limit;	/* Clipped samples a sweep may have */
+	uint16_t low_level;	/* Peak magnitude below which a sweep is weak */
+	uint16_t hold;	/* Weak sweeps in a row before stepping up */
+} gain_control_config_t;
+
+bool gain_control_configure(const gain_control_config_t* const config);
+void gain_control_reset(const bool sweeps);
+bool gain_control_running(void);
+void gain_control_packet(const uint32_t* const p);
+bool gain_control_edge(void);
+void gain_control_segment_closed(void);
+uint_fast8_t gain_control_active(void);
+void gain_control_process(void);
+
+#endif/*__GAIN_CONTROL_H__*/
@@ -21,6 +21,7 @@
  */
 
 #include <stddef.h>
+#include <string.h>
 
 #include <libopencm3/cm3/vector.h>
 
@@ -47,12 +48,18 @@
 #include "rf_path.h"
 #include "sgpio_isr.h"
 #include "usb_bulk_buffer.h"
+#include "stream_format.h"
 #include "sgpio.h"
+#include "sgpio_dma.h"
+#include "m0_state.h"
+#include "capture_stats.h"
+#include "range_profile.h"
+#include "sweep_profile.h"
+#include "gain_control.h"
 #include "mcp4022.h"
 
 static volatile transceiver_mode_t _transceiver_mode = TRANSCEIVER_MODE_OFF;
-
-static unsigned int phase = 1;
+static volatile capture_mode_t _capture_mode = CAPTURE_MODE_ISR;
 
 void set_transceiver_mode(const transceiver_mode_t new_transceiver_mode) {
 	baseband_streaming_disable();
@@ -62,16 +69,34 @@ void set_transceiver_mode(const transceiver_mode_t new_transceiver_mode) {
 
 	_transceiver_mode = new_transceiver_mode;
 
+	// M0 image only writes the raw format, others use the M4 interrupt
+	const bool m0 = (_capture_mode == CAPTURE_MODE_M0)
+		&& (stream_format() == STREAM_FORMAT_RAW);
+
+	// Profile switches follow the ramps whenever the M4 sees the sync edges
+	sweep_profile_reset((_transceiver_mode == TRANSCEIVER_MODE_RX) && !m0);
+	// Gain control judges sweeps of samples, which range profiles don't keep
+	gain_control_reset((_transceiver_mode == TRANSCEIVER_MODE_RX)
+		&& (stream_format() != STREAM_FORMAT_RAW)
+		&& (stream_format() != STREAM_FORMAT_RANGE));
+
+	// After the resets above, the first segment opens with their state
 	if( _transceiver_mode == TRANSCEIVER_MODE_RX ) {
         usb_endpoint_init(&usb_endpoint_bulk_in);
-        usb_bulk_buffer_offset = 0;
-        phase = 1;
+        stream_format_reset();
+        capture_stats_reset(m0);
 	} else if (_transceiver_mode == TRANSCEIVER_MODE_TX) {
 		//usb_endpoint_init(&usb_endpoint_bulk_out);
 	}
 
 	if( _transceiver_mode != TRANSCEIVER_MODE_OFF ) {
-		baseband_streaming_enable();
+		if( _capture_mode == CAPTURE_MODE_DMA ) {
+			baseband_streaming_dma_enable(&sgpio_dma_lli[0]);
+		} else if( m0 ) {
+			baseband_streaming_m0_enable();
+		} else {
+			baseband_streaming_enable();
+		}
 	}
 }
 
@@ -99,6 +124,121 @@ usb_request_status_t usb_vendor_request_set_transceiver_mode(
 	}
 }
 
+usb_request_status_t usb_vendor_request_set_capture_mode(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		switch( endpoint->setup.value ) {
+		case CAPTURE_MODE_ISR:
+		case CAPTURE_MODE_DMA:
+		case CAPTURE_MODE_M0:
+			_capture_mode = endpoint->setup.value;
+			/* Restart a running capture with the new mode */
+			if( _transceiver_mode != TRANSCEIVER_MODE_OFF ) {
+				set_transceiver_mode(_transceiver_mode);
+			}
+			usb_transfer_schedule_ack(endpoint->in);
+			return USB_REQUEST_STATUS_OK;
+		default:
+			return USB_REQUEST_STATUS_STALL;
+		}
+	} else {
+		return USB_REQUEST_STATUS_OK;
+	}
+}
+
+usb_request_status_t usb_vendor_request_set_stream_format(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		switch( endpoint->setup.value ) {
+		case STREAM_FORMAT_RAW:
+		case STREAM_FORMAT_INT16:
+		case STREAM_FORMAT_PACKED10:
+		case STREAM_FORMAT_RAW40:
+		case STREAM_FORMAT_RANGE:
+			stream_format_set(endpoint->setup.value);
+			if( _transceiver_mode != TRANSCEIVER_MODE_OFF ) {
+				set_transceiver_mode(_transceiver_mode);
+			}
+			usb_transfer_schedule_ack(endpoint->in);
+			return USB_REQUEST_STATUS_OK;
+		default:
+			return USB_REQUEST_STATUS_STALL;
+		}
+	} else {
+		return USB_REQUEST_STATUS_OK;
+	}
+}
+
+usb_request_status_t usb_vendor_request_set_decimation(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		const uint32_t factor = endpoint->setup.value;
+		if( (factor == 0) || (factor > STREAM_DECIMATION_MAX) || (factor & (factor - 1)) ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
+		stream_format_set_decimation(__builtin_ctz(factor));
+		if( _transceiver_mode != TRANSCEIVER_MODE_OFF ) {
+			set_transceiver_mode(_transceiver_mode);
+		}
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
+usb_request_status_t usb_vendor_request_set_range_bins(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		if( (endpoint->setup.value == 0) || (endpoint->setup.value > RANGE_BINS_MAX) ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
+		range_profile_set_bins(endpoint->setup.value);
+		if( _transceiver_mode != TRANSCEIVER_MODE_OFF ) {
+			set_transceiver_mode(_transceiver_mode);
+		}
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
+usb_request_status_t usb_vendor_request_read_overruns(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		// Same count as the overruns field of the stats
+		capture_stats_t stats;
+		capture_stats_read(&stats);
+		const uint32_t overruns = stats.overruns;
+		memcpy(endpoint->buffer, &overruns, sizeof(overruns));
+		usb_transfer_schedule_block(endpoint->in, &endpoint->buffer, sizeof(overruns), NULL, NULL);
+		usb_transfer_schedule_ack(endpoint->out);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
+usb_request_status_t usb_vendor_request_read_stats(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	/* Larger than endpoint->buffer, and must stay valid until sent */
+	static capture_stats_t stats;
+
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		capture_stats_read(&stats);
+		usb_transfer_schedule_block(endpoint->in, &stats, sizeof(stats), NULL, NULL);
+		usb_transfer_schedule_ack(endpoint->out);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
 static const usb_request_handler_fn vendor_request_handler[] = {
 	NULL,
 	usb_vendor_request_set_transceiver_mode,
@@ -108,22 +248,22 @@ static const usb_request_handler_fn vendor_request_handler[] = {
     usb_vendor_request_clear_gpio,
     usb_vendor_request_set_mcp,
     usb_vendor_request_set_clock,
-    NULL,
-    NULL,
+    usb_vendor_request_set_capture_mode,
+    usb_vendor_request_set_stream_format,
 	usb_vendor_request_erase_spiflash,
 	usb_vendor_request_write_spiflash,
 	usb_vendor_request_read_spiflash,
-	NULL,
+	usb_vendor_request_read_overruns,
 	usb_vendor_request_read_board_id,
 	usb_vendor_request_read_version_string,
-    NULL,
-    NULL,
+	usb_vendor_request_read_stats,
+	usb_vendor_request_set_decimation,
 	usb_vendor_request_read_partid_serialno,
-    NULL,
-    NULL,
-    NULL,
-	NULL,
-	NULL,
+	usb_vendor_request_set_range_bins,
+	usb_vendor_request_write_adf4158_image,
+	usb_vendor_request_load_sweep_profile,
+	usb_vendor_request_select_sweep_profile,
+	usb_vendor_request_set_gain_control,
     NULL,
 };
 
@@ -224,6 +364,14 @@ int main(void) {
 
 	nvic_set_priority(NVIC_USB0_IRQ, 255);
     vector_table.irq[NVIC_SGPIO_IRQ] = sgpio_isr_rx;
+    vector_table.irq[NVIC_DMA_IRQ] = sgpio_dma_isr_rx;
+    vector_table.irq[NVIC_M0CORE_IRQ] = sgpio_m0_isr_rx;
+
+    sgpio_dma_init();
+    sgpio_dma_isr_setup();
+
+    m0_state.segment_state = usb_bulk_segment_state;
+    capture_stats_init();
 
 	usb_run(&usb_device);
 
@@ -234,35 +382,20 @@ int main(void) {
     mcp_init();
 
 	while(true) {
+		sweep_profile_process();
+		gain_control_process();
 
-    //gpio_set(PORT_LED1_3, PIN_LED1);
-		// Set up IN transfer of buffer 0.
-		if ( usb_bulk_buffer_offset >= 16384
-		     && phase == 1
-		     && transceiver_mode() != TRANSCEIVER_MODE_OFF) {
-			usb_transfer_schedule_block(
-				(transceiver_mode() == TRANSCEIVER_MODE_RX)
-				? &usb_endpoint_bulk_in : &usb_endpoint_bulk_out,
-				&usb_bulk_buffer[0x0000],
-				0x4000,
-				NULL, NULL
-				);
-			phase = 0;
+		if( (transceiver_mode() == TRANSCEIVER_MODE_RX)
+		    && (stream_format() == STREAM_FORMAT_RANGE) ) {
+			range_profile_process();
 		}
-    //gpio_clear(PORT_LED1_3, PIN_LED1);
 
-		// Set up IN transfer of buffer 1.
-		if ( usb_bulk_buffer_offset < 16384
-		     && phase == 0
-		     && transceiver_mode() != TRANSCEIVER_MODE_OFF) {
-			usb_transfer_schedule_block(
+		// Queue IN transfers of the segments capture has filled
+		if( transceiver_mode() != TRANSCEIVER_MODE_OFF ) {
+			usb_bulk_segment_schedule(
 				(transceiver_mode() == TRANSCEIVER_MODE_RX)
-				? &usb_endpoint_bulk_in : &usb_endpoint_bulk_out,
-				&usb_bulk_buffer[0x4000],
-				0x4000-32, // Last 32 bytes are unused
-				NULL, NULL
+				? &usb_endpoint_bulk_in : &usb_endpoint_bulk_out
 			);
-			phase = 1;
 		}
 	}
 
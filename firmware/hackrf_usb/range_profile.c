@@ -0,0 +1,291 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "range_profile.h"
+
+#include <stdbool.h>
+
+#include "usb_bulk_buffer.h"
+#include "stream_format.h"
+#include "capture_stats.h"
+#include "sweep_profile.h"
+#include "gain_control.h"
+
+#define RANGE_COMPLEX_SIZE (RANGE_FFT_SIZE / 2)
+
+typedef enum {
+	SWEEP_FREE = 0,
+	SWEEP_FILLING = 1,
+	SWEEP_READY = 2
+} sweep_state_t;
+
+static volatile uint32_t _bins = 128;
+
+// Sweeps filled by capture and transformed by the main loop in turn
+static int16_t sweep[2][RANGE_FFT_SIZE];
+static volatile uint8_t sweep_state[2];
+static volatile uint32_t sweep_length[2];
+static volatile uint32_t sweep_number[2];
+static volatile uint8_t sweep_profile_id[2];
+static uint_fast8_t fill;
+static uint_fast8_t fill_next;
+static uint32_t sweep_count;
+
+// Main loop state
+static float work[RANGE_FFT_SIZE];
+static float cos_table[RANGE_FFT_SIZE / 4 + 1];
+static uint_fast8_t process;
+static uint32_t bins;
+static uint32_t segment;
+static uint32_t profiles;
+static uint32_t next_profile;
+static uint_fast8_t segment_profile_id;
+static bool segment_open;
+
+void range_profile_set_bins(const uint32_t new_bins) {
+	_bins = new_bins;
+}
+
+/* cos(2 pi k / RANGE_FFT_SIZE) from the quarter wave table */
+static float cos_index(uint32_t k) {
+	k &= RANGE_FFT_SIZE - 1;
+	if( k <= RANGE_FFT_SIZE / 4 ) {
+		return cos_table[k];
+	} else if( k <= RANGE_FFT_SIZE / 2 ) {
+		return -cos_table[RANGE_FFT_SIZE / 2 - k];
+	} else if( k <= RANGE_FFT_SIZE * 3 / 4 ) {
+		return -cos_table[k - RANGE_FFT_SIZE / 2];
+	} else {
+		return cos_table[RANGE_FFT_SIZE - k];
+	}
+}
+
+static float sin_index(const uint32_t k) {
+	return cos_index(k + RANGE_FFT_SIZE * 3 / 4);
+}
+
+/* cos(2 pi phase / (RANGE_FFT_SIZE << 16)), interpolated between table
+ * entries for windows that don't span RANGE_FFT_SIZE samples */
+static float cos_phase(const uint32_t phase) {
+	const uint32_t k = phase >> 16;
+	const float f = (phase & 0xFFFF) * (1.0f / 65536.0f);
+	const float c = cos_index(k);
+	return c + f * (cos_index(k + 1) - c);
+}
+
+static float sqrt_f32(const float x) {
+	float result;
+	__asm__("vsqrt.f32 %0, %1" : "=t" (result) : "t" (x));
+	return result;
+}
+
+/* Only call with capture stopped */
+void range_profile_reset(void) {
+	// Rotate in double precision, once per capture
+	double c = 1.0, s = 0.0;
+	const double cd = 0.99998117528260111;	/* cos(2 pi / 1024) */
+	const double sd = 0.0061358846491544753;	/* sin(2 pi / 1024) */
+	for(uint32_t k=0; k<=RANGE_FFT_SIZE / 4; k++) {
+		cos_table[k] = c;
+		const double t = c * cd - s * sd;
+		s = s * cd + c * sd;
+		c = t;
+	}
+
+	for(uint_fast8_t b=0; b<2; b++) {
+		sweep_state[b] = SWEEP_FREE;
+	}
+	fill = 0;
+	fill_next = 0;
+	sweep_count = 0;
+	process = 0;
+	bins = _bins;
+	segment_open = false;
+}
+
+static void sweep_begin(void) {
+	const uint32_t number = sweep_count++;
+	if( sweep_state[fill_next] != SWEEP_FREE ) {
+		// Both buffers waiting for the FFT, drop this sweep
+		capture_stats.overruns++;
+		return;
+	}
+	fill = fill_next;
+	fill_next ^= 1;
+	sweep_length[fill] = 0;
+	sweep_number[fill] = number;
+	sweep_profile_id[fill] = sweep_profile_active();
+	sweep_state[fill] = SWEEP_FILLING;
+}
+
+static void sweep_append(const int16_t* x, uint_fast8_t n) {
+	if( sweep_state[fill] != SWEEP_FILLING ) {
+		return;
+	}
+	uint32_t length = sweep_length[fill];
+	while( n-- && length < RANGE_FFT_SIZE ) {
+		sweep[fill][length++] = *x++;
+	}
+	sweep_length[fill] = length;
+	if( length == RANGE_FFT_SIZE ) {
+		sweep_state[fill] = SWEEP_READY;
+	}
+}
+
+/* Called by capture with the int16 samples of a packet and the index of
+ * its first falling sync edge, or -1 */
+void range_profile_packet(const int16_t* const x, const uint_fast8_t n, int_fast8_t edge) {
+	if( edge < 0 ) {
+		sweep_append(x, n);
+		return;
+	}
+	// With decimation an edge can fall in the output still being summed
+	if( edge > n ) {
+		edge = n;
+	}
+
+	sweep_append(x, edge);
+	if( sweep_state[fill] == SWEEP_FILLING ) {
+		sweep_state[fill] = SWEEP_READY;
+	}
+	sweep_begin();
+	sweep_append(x + edge, n - edge);
+}
+
+/* In place radix-2 FFT of RANGE_COMPLEX_SIZE interleaved complex values */
+static void fft_complex(float* const z) {
+	for(uint32_t i=1, j=0; i<RANGE_COMPLEX_SIZE; i++) {
+		uint32_t bit = RANGE_COMPLEX_SIZE >> 1;
+		for(; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j |= bit;
+		if( i < j ) {
+			const float re = z[2*i], im = z[2*i+1];
+			z[2*i] = z[2*j];
+			z[2*i+1] = z[2*j+1];
+			z[2*j] = re;
+			z[2*j+1] = im;
+		}
+	}
+
+	for(uint32_t len=2; len<=RANGE_COMPLEX_SIZE; len<<=1) {
+		const uint32_t step = RANGE_FFT_SIZE / len;
+		for(uint32_t k=0; k<len/2; k++) {
+			const float wr = cos_index(k * step);
+			const float wi = -sin_index(k * step);
+			for(uint32_t i=k; i<RANGE_COMPLEX_SIZE; i+=len) {
+				const uint32_t j = i + len/2;
+				const float tr = wr * z[2*j] - wi * z[2*j+1];
+				const float ti = wr * z[2*j+1] + wi * z[2*j];
+				z[2*j] = z[2*i] - tr;
+				z[2*j+1] = z[2*i+1] - ti;
+				z[2*i] += tr;
+				z[2*i+1] += ti;
+			}
+		}
+	}
+}
+
+static void segment_close(void) {
+	stream_segment_header_t* const header = (stream_segment_header_t*)&usb_bulk_buffer[segment];
+	header->header_size = sizeof(stream_segment_header_t);
+	header->format = STREAM_FORMAT_RANGE;
+	header->samples = profiles * bins;
+	header->syncs = 0;
+	header->sequence = stream_format_next_sequence();
+	header->first_sample = (next_profile - profiles) * bins;
+	header->profile = segment_profile_id;
+	header->flags = stream_format_segment_flags();
+	header->gain_sync = STREAM_GAIN_SYNC_NONE;
+	// Gain control doesn't step the gain of range profiles
+	header->gain = gain_control_active();
+	header->gain_start = header->gain;
+	segment_open = false;
+	usb_bulk_segment_complete();
+}
+
+/* Returns where the next profile goes, or 0 when USB is full */
+static float* profile_slot(const uint32_t number, const uint_fast8_t profile_id) {
+	const uint32_t per_segment = (USB_BULK_SEGMENT_SIZE - sizeof(stream_segment_header_t)) / (bins * 4);
+
+	// Segments hold consecutive profiles of one sweep profile only
+	if( segment_open && ((profiles == per_segment) || (number != next_profile)
+	                     || (profile_id != segment_profile_id)) ) {
+		segment_close();
+	}
+
+	if( !segment_open ) {
+		if( usb_bulk_buffer_stalled && !usb_bulk_buffer_resume() ) {
+			return 0;
+		}
+		segment = usb_bulk_segment_start();
+		profiles = 0;
+		segment_profile_id = profile_id;
+		segment_open = true;
+	}
+
+	next_profile = number + 1;
+	return (float*)&usb_bulk_buffer[segment + sizeof(stream_segment_header_t) + profiles++ * bins * 4];
+}
+
+/* Transform the next finished sweep, called from the main loop */
+void range_profile_process(void) {
+	if( sweep_state[process] != SWEEP_READY ) {
+		return;
+	}
+
+	// Hann window over the samples of the sweep, zero padded past its end
+	const uint32_t length = sweep_length[process];
+	const int16_t* const x = sweep[process];
+	const uint32_t step = length ? (RANGE_FFT_SIZE << 16) / length : 0;
+	uint32_t phase = 0;
+	for(uint32_t i=0; i<RANGE_FFT_SIZE; i++) {
+		work[i] = (i < length) ? x[i] * (0.5f - 0.5f * cos_phase(phase)) : 0.0f;
+		phase = (phase + step) & ((RANGE_FFT_SIZE << 16) - 1);
+	}
+	const uint32_t number = sweep_number[process];
+	const uint_fast8_t profile_id = sweep_profile_id[process];
+	sweep_state[process] = SWEEP_FREE;
+	process ^= 1;
+
+	fft_complex(work);
+
+	float* const out = profile_slot(number, profile_id);
+	if( !out ) {
+		return;
+	}
+
+	// Split the half size complex transform into the real transform
+	for(uint32_t k=0; k<bins; k++) {
+		const uint32_t m = (RANGE_COMPLEX_SIZE - k) & (RANGE_COMPLEX_SIZE - 1);
+		const float ar = work[2*k], ai = work[2*k+1];
+		const float br = work[2*m], bi = work[2*m+1];
+		const float er = 0.5f * (ar + br);
+		const float ei = 0.5f * (ai - bi);
+		const float odr = 0.5f * (ai + bi);
+		const float odi = -0.5f * (ar - br);
+		const float wr = cos_index(k);
+		const float wi = -sin_index(k);
+		const float re = er + wr * odr - wi * odi;
+		const float im = ei + wr * odi + wi * odr;
+		out[k] = sqrt_f32(re * re + im * im);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __RANGE_PROFILE_H__
+#define __RANGE_PROFILE_H__
+
+#include <stdint.h>
+
+/* STREAM_FORMAT_RANGE sends range profiles instead of samples. Capture
+ * collects up to RANGE_FFT_SIZE int16 samples, after any decimation, from
+ * each falling sync edge. Longer sweeps are cut off, so the host picks a
+ * decimation that fits the sweep. The main loop applies a Hann window over
+ * the samples collected, zero pads to RANGE_FFT_SIZE, runs a real FFT and
+ * writes the magnitudes of the first bins as float32 to framed segments.
+ *
+ * In the segment header samples and first_sample count float values, so a
+ * profile starts at every multiple of bins. Profiles dropped because the
+ * FFT fell behind or USB was full show up as gaps in first_sample. A
+ * segment only holds sweeps of the sweep profile in its header.
+ */
+#define RANGE_FFT_SIZE (1024)
+#define RANGE_BINS_MAX (RANGE_FFT_SIZE / 2)
+
+void range_profile_set_bins(const uint32_t bins);
+void range_profile_reset(void);
+void range_profile_packet(const int16_t* const x, const uint_fast8_t n, int_fast8_t edge);
+void range_profile_process(void);
+
+#endif/*__RANGE_PROFILE_H__*/
@@ -26,12 +26,40 @@
 #include <libopencm3/lpc43xx/sgpio.h>
 #include "hackrf_core.h"
 
+#include <libopencm3/lpc43xx/ipc.h>
+
+#include <gpdma.h>
+#include <sgpio_dma.h>
+
 #include "usb_bulk_buffer.h"
+#include "stream_format.h"
+#include "capture_stats.h"
+
+/* GPDMA capture copies all 16 slice shadow registers per exchange into a
+ * record indexed by slice, the interrupt fires when half of the records are
+ * filled. */
+#define SGPIO_DMA_RECORD_WORDS (16)
+#define SGPIO_DMA_RECORD_COUNT (128)
+
+static uint32_t sgpio_dma_buffer[SGPIO_DMA_RECORD_COUNT][SGPIO_DMA_RECORD_WORDS];
+gpdma_lli_t sgpio_dma_lli[SGPIO_DMA_RECORD_COUNT];
 
 void sgpio_isr_rx() {
+	const uint32_t entry = SCS_DWT_CYCCNT;
 	SGPIO_CLR_STATUS_1 = (1 << SGPIO_SLICE_A);
+	capture_stats.interrupts++;
+	capture_stats.packets++;
+
+	const bool raw = (stream_format() == STREAM_FORMAT_RAW);
+	if( raw && usb_bulk_buffer_stalled && !usb_bulk_buffer_resume() ) {
+		stream_format_sync_edges(SGPIO_REG_SS(SGPIO_SLICE_H));
+		capture_stats_isr(entry);
+		return;
+	}
 
-	uint32_t* const p = (uint32_t*)&usb_bulk_buffer[usb_bulk_buffer_offset];
+	// Framed formats are converted from a packet on the stack
+	uint32_t packet[11];
+	uint32_t* const p = raw ? (uint32_t*)&usb_bulk_buffer[usb_bulk_buffer_offset] : packet;
 	__asm__(
 		"ldr r0, [%[SGPIO_REG_SS], #44]\n\t"
 		"str r0, [%[p], #0]\n\t"
@@ -79,9 +107,87 @@ void sgpio_isr_rx() {
     p[10] = SGPIO_REG_SS(SGPIO_SLICE_H);
     */
 
+    if (!raw) {
+        stream_format_packet(packet);
+        capture_stats_isr(entry);
+        return;
+    }
+
+    stream_format_sync_edges(p[10]);
     usb_bulk_buffer_offset += 11*4;
-    if (usb_bulk_buffer_offset > usb_bulk_buffer_size-11*4) {
-        usb_bulk_buffer_offset = 0;
+    if (usb_bulk_buffer_offset == usb_bulk_segment_end) {
+        usb_bulk_segment_complete();
     }
+    capture_stats_isr(entry);
+}
+
+void sgpio_dma_isr_setup(void) {
+	sgpio_dma_configure_lli(sgpio_dma_lli, SGPIO_DMA_RECORD_COUNT,
+		sgpio_dma_buffer, SGPIO_DMA_RECORD_WORDS * 4);
+	gpdma_lli_enable_interrupt(&sgpio_dma_lli[SGPIO_DMA_RECORD_COUNT / 2 - 1]);
+	gpdma_lli_enable_interrupt(&sgpio_dma_lli[SGPIO_DMA_RECORD_COUNT - 1]);
 }
 
+void sgpio_dma_isr_rx() {
+	const uint32_t entry = SCS_DWT_CYCCNT;
+	sgpio_dma_irq_tc_acknowledge();
+	capture_stats.interrupts++;
+	if( sgpio_dma_irq_error_acknowledge() ) {
+		// The channel halts on a bus error, start over at the first record
+		capture_stats.dma_errors++;
+		sgpio_dma_rx_start(&sgpio_dma_lli[0]);
+		capture_stats_isr(entry);
+		return;
+	}
+	capture_stats.packets += SGPIO_DMA_RECORD_COUNT / 2;
+
+	/* Pack the half that DMA isn't writing into the same layout as
+	 * sgpio_isr_rx(). */
+	const uint32_t (*ss)[SGPIO_DMA_RECORD_WORDS] = &sgpio_dma_buffer[0];
+	if( (uint8_t*)sgpio_dma_current_destination() < (uint8_t*)&sgpio_dma_buffer[SGPIO_DMA_RECORD_COUNT / 2] ) {
+		ss = &sgpio_dma_buffer[SGPIO_DMA_RECORD_COUNT / 2];
+	}
+
+	uint32_t packet[11];
+	const bool raw = (stream_format() == STREAM_FORMAT_RAW);
+	for(size_t i=0; i<SGPIO_DMA_RECORD_COUNT / 2; i++) {
+		if( raw && usb_bulk_buffer_stalled && !usb_bulk_buffer_resume() ) {
+			stream_format_sync_edges(ss[i][SGPIO_SLICE_H]);
+			continue;
+		}
+
+		uint32_t* const p = raw ? (uint32_t*)&usb_bulk_buffer[usb_bulk_buffer_offset] : packet;
+		// D9 - D2
+		p[0] = ss[i][SGPIO_SLICE_L];
+		p[1] = ss[i][SGPIO_SLICE_F];
+		p[2] = ss[i][SGPIO_SLICE_K];
+		p[3] = ss[i][SGPIO_SLICE_C];
+		p[4] = ss[i][SGPIO_SLICE_J];
+		p[5] = ss[i][SGPIO_SLICE_E];
+		p[6] = ss[i][SGPIO_SLICE_I];
+		p[7] = ss[i][SGPIO_SLICE_A];
+		// D1
+		p[8] = ss[i][SGPIO_SLICE_G];
+		// D0
+		p[9] = ss[i][SGPIO_SLICE_N];
+		// Sync
+		p[10] = ss[i][SGPIO_SLICE_H];
+
+		if( !raw ) {
+			stream_format_packet(packet);
+			continue;
+		}
+
+		stream_format_sync_edges(p[10]);
+		usb_bulk_buffer_offset += 11*4;
+		if (usb_bulk_buffer_offset == usb_bulk_segment_end) {
+			usb_bulk_segment_complete();
+		}
+	}
+	capture_stats_isr(entry);
+}
+
+void sgpio_m0_isr_rx() {
+	/* The M0 marks segments ready itself, the main loop picks them up */
+	ipc_m0apptxevent_clear();
+}
@@ -23,6 +23,15 @@
 #ifndef __SGPIO_ISR_H__
 #define __SGPIO_ISR_H__
 
+#include <libopencm3/lpc43xx/gpdma.h>
+
+extern gpdma_lli_t sgpio_dma_lli[];
+
 void sgpio_isr_rx();
 
+void sgpio_dma_isr_setup(void);
+void sgpio_dma_isr_rx();
+
+void sgpio_m0_isr_rx();
+
 #endif/*__SGPIO_ISR_H__*/
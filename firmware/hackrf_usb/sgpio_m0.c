@@ -0,0 +1,146 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* M0 image for CAPTURE_MODE_M0. The M4 copies it to ram_m0 and releases the
+ * M0 from reset when streaming starts, and holds it in reset otherwise. The
+ * M0 takes the SGPIO exchange interrupt, packs the shadow registers into
+ * usb_bulk_buffer in the same layout as sgpio_isr_rx() and follows the same
+ * segment protocol as the M4 capture code (see usb_bulk_buffer.h), raising
+ * TXEV to the M4 every time a segment is ready.
+ */
+
+#include <stdint.h>
+
+#include <libopencm3/cm3/vector.h>
+#include <libopencm3/lpc43xx/sgpio.h>
+
+#include <m0_state.h>
+
+#include "usb_bulk_buffer.h"
+
+/* The libopencm3 M0 library has no startup code, provide a minimal one */
+extern unsigned _stack;
+
+void reset_handler(void);
+void blocking_handler(void);
+void sgpio_m0_isr_rx(void);
+
+__attribute__ ((section(".vectors")))
+vector_table_t vector_table = {
+	.initial_sp_value = &_stack,
+	.reset = reset_handler,
+	.nmi = blocking_handler,
+	.hard_fault = blocking_handler,
+	.irq = {
+		[NVIC_SGPIO_IRQ] = sgpio_m0_isr_rx,
+	},
+};
+
+static uint32_t segment;
+static uint32_t offset;
+static uint32_t end;
+static bool stalled;
+
+static void segment_open(void) {
+	offset = segment * USB_BULK_SEGMENT_SIZE;
+	end = offset + USB_BULK_SEGMENT_SIZE;
+}
+
+void blocking_handler(void) {
+	while(1) {
+
+	}
+}
+
+void sgpio_m0_isr_rx(void) {
+	SGPIO_CLR_STATUS_1 = (1 << SGPIO_SLICE_A);
+	m0_state.interrupts++;
+	m0_state.packets++;
+
+	if( stalled ) {
+		if( m0_state.segment_state[segment] != USB_BULK_SEGMENT_FREE ) {
+			m0_state.overruns++;
+			return;
+		}
+		stalled = false;
+		segment_open();
+	}
+
+	uint32_t* const p = (uint32_t*)&usb_bulk_buffer[offset];
+	__asm__(
+		"ldr r0, [%[SGPIO_REG_SS], #44]\n\t"
+		"str r0, [%[p], #0]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #20]\n\t"
+		"str r0, [%[p], #4]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #40]\n\t"
+		"str r0, [%[p], #8]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #8]\n\t"
+		"str r0, [%[p], #12]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #36]\n\t"
+		"str r0, [%[p], #16]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #16]\n\t"
+		"str r0, [%[p], #20]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #32]\n\t"
+		"str r0, [%[p], #24]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #0]\n\t"
+		"str r0, [%[p], #28]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #24]\n\t"
+		"str r0, [%[p], #32]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #52]\n\t"
+		"str r0, [%[p], #36]\n\t"
+		"ldr r0, [%[SGPIO_REG_SS], #28]\n\t"
+		"str r0, [%[p], #40]\n\t"
+		:
+		: [SGPIO_REG_SS] "l" (SGPIO_PORT_BASE + 0x100),
+		  [p] "l" (p)
+		: "r0"
+	);
+
+	offset += 11*4;
+	if( offset == end ) {
+		m0_state.segment_state[segment] = USB_BULK_SEGMENT_READY;
+		if( ++segment == USB_BULK_SEGMENT_COUNT ) {
+			segment = 0;
+		}
+		if( m0_state.segment_state[segment] == USB_BULK_SEGMENT_FREE ) {
+			segment_open();
+		} else {
+			stalled = true;
+		}
+		__asm__("sev");
+	}
+}
+
+int main(void) {
+	segment = 0;
+	stalled = false;
+	segment_open();
+
+	/* SGPIO is the only interrupt, leave it at the reset priority */
+	NVIC_ISER(NVIC_SGPIO_IRQ / 32) = (1 << (NVIC_SGPIO_IRQ % 32));
+
+	while(1) {
+		__asm__("wfi");
+	}
+}
+
+void __attribute__ ((naked)) reset_handler(void) {
+	main();
+	blocking_handler();
+}
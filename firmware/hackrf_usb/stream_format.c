@@ -0,0 +1,301 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "stream_format.h"
+
+#include <libopencm3/lpc43xx/gpio.h>
+
+#include "usb_bulk_buffer.h"
+#include "capture_stats.h"
+#include "range_profile.h"
+#include "sweep_profile.h"
+#include "gain_control.h"
+
+/* Worst case space a packet takes in a segment: 31 int16 samples and a
+ * falling sync edge on every other sample. */
+#define STREAM_PACKET_MAX (STREAM_SAMPLES_PER_PACKET * 2 + 16 * 2)
+
+/* CIC decimator order, bit growth is STREAM_CIC_ORDER * log2(factor) */
+#define STREAM_CIC_ORDER (3)
+
+static volatile stream_format_t _stream_format = STREAM_FORMAT_RAW;
+static volatile uint_fast8_t _decimation_log2 = 0;
+
+static uint32_t segment;
+static uint32_t sync_offset;
+static uint32_t samples;
+static uint32_t sequence;
+static uint32_t first_sample;
+static uint_fast8_t first_profile;
+static uint16_t gain_sync;
+static uint8_t first_gain;
+static uint32_t stream_sample;
+static volatile uint32_t trigger_packets;
+static uint32_t trigger_packets_seen;
+static uint32_t bits;
+static uint_fast8_t bit_count;
+static uint_fast8_t sync_phase;
+
+// Decimation of the current capture, input samples into the next output
+static uint_fast8_t decimation_log2;
+static uint_fast8_t decimation_phase;
+static uint_fast8_t cic_shift_left;
+static uint_fast8_t cic_shift_right;
+// CIC state wraps modulo 2^32, the output is still exact
+static uint32_t cic_integrator[STREAM_CIC_ORDER];
+static uint32_t cic_comb[STREAM_CIC_ORDER];
+
+void stream_format_set(const stream_format_t new_format) {
+	_stream_format = new_format;
+}
+
+stream_format_t stream_format(void) {
+	return _stream_format;
+}
+
+/* Factor is a power of two up to STREAM_DECIMATION_MAX, applied to
+ * STREAM_FORMAT_INT16 and STREAM_FORMAT_RANGE only */
+void stream_format_set_decimation(const uint_fast8_t factor_log2) {
+	_decimation_log2 = factor_log2;
+}
+
+static void segment_open(const uint32_t sample) {
+	segment = usb_bulk_segment_start();
+	first_sample = sample;
+	first_profile = sweep_profile_active();
+	first_gain = gain_control_active();
+	gain_sync = STREAM_GAIN_SYNC_NONE;
+	sync_offset = segment + USB_BULK_SEGMENT_SIZE;
+	samples = 0;
+	bits = 0;
+	bit_count = 0;
+	usb_bulk_buffer_offset = segment + sizeof(stream_segment_header_t);
+}
+
+static void segment_close(void) {
+	if( bit_count ) {
+		usb_bulk_buffer[usb_bulk_buffer_offset++] = bits;
+	}
+
+	stream_segment_header_t* const header = (stream_segment_header_t*)&usb_bulk_buffer[segment];
+	header->header_size = sizeof(stream_segment_header_t);
+	header->format = _stream_format;
+	header->samples = samples;
+	header->syncs = (segment + USB_BULK_SEGMENT_SIZE - sync_offset) / 2;
+	header->sequence = sequence++;
+	header->first_sample = first_sample;
+	header->profile = first_profile;
+	header->flags = stream_format_segment_flags();
+	header->gain_sync = gain_sync;
+	header->gain = gain_control_active();
+	header->gain_start = first_gain;
+
+	gain_control_segment_closed();
+	usb_bulk_segment_complete();
+}
+
+/* Sequence number for the next segment, for segments written elsewhere */
+uint32_t stream_format_next_sequence(void) {
+	return sequence++;
+}
+
+/* Flags for the segment being closed. Counting trigger packets lets the
+ * main loop close range profile segments without racing the ISR. */
+uint16_t stream_format_segment_flags(void) {
+	const uint32_t count = trigger_packets;
+	const uint16_t flags = (count != trigger_packets_seen) ? STREAM_SEGMENT_TRIGGER : 0;
+	trigger_packets_seen = count;
+	return flags;
+}
+
+void stream_format_reset(void) {
+	sync_phase = 1;
+	trigger_packets = 0;
+	trigger_packets_seen = 0;
+	sequence = 0;
+	stream_sample = 0;
+
+	decimation_log2 = ((_stream_format == STREAM_FORMAT_INT16) || (_stream_format == STREAM_FORMAT_RANGE))
+		? _decimation_log2 : 0;
+	decimation_phase = 0;
+	for(uint_fast8_t i=0; i<STREAM_CIC_ORDER; i++) {
+		cic_integrator[i] = 0;
+		cic_comb[i] = 0;
+	}
+	// Scale the CIC gain of factor^order so outputs have 5 fractional bits
+	const int_fast8_t shift = STREAM_CIC_ORDER * decimation_log2 - STREAM_DECIMATION_FRACTION_BITS;
+	cic_shift_right = (shift > 0) ? shift : 0;
+	cic_shift_left = (shift < 0) ? -shift : 0;
+	usb_bulk_buffer_reset();
+	if( _stream_format == STREAM_FORMAT_RANGE ) {
+		range_profile_reset();
+	} else if( _stream_format != STREAM_FORMAT_RAW ) {
+		segment_open(0);
+	}
+}
+
+/* Falling edges in a packet's sync word, bit j set for an edge at sample j.
+ * Carries the last sample over to the next packet, counts the edges and
+ * passes them to sweep_profile_edge(), so call it exactly once per packet,
+ * dropped ones included.
+ */
+uint32_t stream_format_sync_edges(const uint32_t sync) {
+	const uint32_t edges = ~sync & ((sync << 1) | sync_phase) & ((1U << STREAM_SAMPLES_PER_PACKET) - 1);
+	sync_phase = (sync >> (STREAM_SAMPLES_PER_PACKET - 1)) & 1;
+
+	for(uint32_t e=edges; e; e &= e - 1) {
+		capture_stats.sync_edges++;
+		sweep_profile_edge();
+	}
+	return edges;
+}
+
+/* Convert a packet to int16 samples at the output rate, phase is the number
+ * of input samples already in the next output. Returns the end of out.
+ */
+static int16_t* packet_int16(const uint32_t* const p, int16_t* out, const uint_fast8_t phase) {
+	// Sample j is bit j of the D1, D0 and sync words and byte j of D9 - D2
+	const int8_t* const d9_d2 = (const int8_t*)p;
+	const uint32_t d1 = p[8];
+	const uint32_t d0 = p[9];
+
+	if( !decimation_log2 ) {
+		for(uint_fast8_t j=0; j<STREAM_SAMPLES_PER_PACKET; j++) {
+			*out++ = (d9_d2[j] << 2) | (((d1 >> j) & 1) << 1) | ((d0 >> j) & 1);
+		}
+		return out;
+	}
+
+	// Integrators run at the input rate, combs at the output rate
+	uint32_t i0 = cic_integrator[0];
+	uint32_t i1 = cic_integrator[1];
+	uint32_t i2 = cic_integrator[2];
+	uint_fast8_t n = phase;
+	for(uint_fast8_t j=0; j<STREAM_SAMPLES_PER_PACKET; j++) {
+		i0 += (int32_t)((d9_d2[j] << 2) | (((d1 >> j) & 1) << 1) | ((d0 >> j) & 1));
+		i1 += i0;
+		i2 += i1;
+		if( ++n >> decimation_log2 ) {
+			n = 0;
+			const uint32_t c0 = i2 - cic_comb[0];
+			cic_comb[0] = i2;
+			const uint32_t c1 = c0 - cic_comb[1];
+			cic_comb[1] = c0;
+			const uint32_t c2 = c1 - cic_comb[2];
+			cic_comb[2] = c1;
+			*out++ = (int32_t)(c2 << cic_shift_left) >> cic_shift_right;
+		}
+	}
+	cic_integrator[0] = i0;
+	cic_integrator[1] = i1;
+	cic_integrator[2] = i2;
+	return out;
+}
+
+/* Convert one packet in the sgpio_isr_rx() layout into the current segment */
+void stream_format_packet(const uint32_t* const p) {
+	// Output sample counter advances for dropped packets as well
+	const uint32_t sample = stream_sample;
+	const uint_fast8_t phase = decimation_phase;
+	const uint_fast8_t outputs = (phase + STREAM_SAMPLES_PER_PACKET) >> decimation_log2;
+	stream_sample += outputs;
+	decimation_phase = (phase + STREAM_SAMPLES_PER_PACKET) & ((1 << decimation_log2) - 1);
+	if( TRIGGER_STATE ) {
+		trigger_packets++;
+	}
+
+	if( _stream_format == STREAM_FORMAT_RANGE ) {
+		// Samples go to a sweep buffer, the main loop fills the segments
+		int16_t x[STREAM_SAMPLES_PER_PACKET];
+		const uint32_t edges = stream_format_sync_edges(p[10]);
+		packet_int16(p, x, phase);
+		range_profile_packet(x, outputs,
+			edges ? (int_fast8_t)((phase + __builtin_ctz(edges)) >> decimation_log2) : -1);
+		return;
+	}
+
+	bool dropped = false;
+	if( usb_bulk_buffer_stalled ) {
+		dropped = !usb_bulk_buffer_resume();
+		if( !dropped ) {
+			segment_open(sample);
+		}
+	} else if( usb_bulk_buffer_offset + STREAM_PACKET_MAX > sync_offset ) {
+		segment_close();
+		dropped = usb_bulk_buffer_stalled && !usb_bulk_buffer_resume();
+		if( !dropped ) {
+			segment_open(sample);
+		}
+	}
+
+	// The packet belongs to the sweep its edges end
+	gain_control_packet(p);
+
+	// Dropped packets still end sweeps, so profile switches, gain steps and
+	// the edge count keep following the ramps through an overrun
+	uint32_t edges = stream_format_sync_edges(p[10]);
+	if( dropped ) {
+		for( ; edges; edges &= edges - 1 ) {
+			gain_control_edge();
+		}
+		return;
+	}
+
+	// A profile switch lands on the first edge, later edges keep it
+	const uint32_t profile = (uint32_t)sweep_profile_active() << STREAM_SYNC_PROFILE_SHIFT;
+	while( edges ) {
+		sync_offset -= 2;
+		*(uint16_t*)&usb_bulk_buffer[sync_offset] = profile | (samples + ((phase + __builtin_ctz(edges)) >> decimation_log2));
+		if( gain_control_edge() ) {
+			gain_sync = (segment + USB_BULK_SEGMENT_SIZE - sync_offset) / 2 - 1;
+		}
+		edges &= edges - 1;
+	}
+
+	if( _stream_format == STREAM_FORMAT_RAW40 ) {
+		// D9 - D0 words as sent in the raw format, without the sync word
+		uint32_t* const out = (uint32_t*)&usb_bulk_buffer[usb_bulk_buffer_offset];
+		for(uint_fast8_t i=0; i<10; i++) {
+			out[i] = p[i];
+		}
+		usb_bulk_buffer_offset += 10*4;
+	} else if( _stream_format == STREAM_FORMAT_INT16 ) {
+		int16_t* const out = packet_int16(p, (int16_t*)&usb_bulk_buffer[usb_bulk_buffer_offset], phase);
+		usb_bulk_buffer_offset = (uint8_t*)out - usb_bulk_buffer;
+	} else {
+		// Little endian bit stream, sample k at bit 10*k
+		const uint8_t* const d9_d2 = (const uint8_t*)p;
+		const uint32_t d1 = p[8];
+		const uint32_t d0 = p[9];
+		uint8_t* out = &usb_bulk_buffer[usb_bulk_buffer_offset];
+		for(uint_fast8_t j=0; j<STREAM_SAMPLES_PER_PACKET; j++) {
+			const uint32_t x = (d9_d2[j] << 2) | (((d1 >> j) & 1) << 1) | ((d0 >> j) & 1);
+			bits |= x << bit_count;
+			bit_count += 10;
+			while( bit_count >= 8 ) {
+				*out++ = bits;
+				bits >>= 8;
+				bit_count -= 8;
+			}
+		}
+		usb_bulk_buffer_offset = out - usb_bulk_buffer;
+	}
+
+	samples += outputs;
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __STREAM_FORMAT_H__
+#define __STREAM_FORMAT_H__
+
+#include <stdint.h>
+
+#include "hackrf_core.h"
+
+/* In the framed formats each usb_bulk_buffer segment starts with a header,
+ * samples follow it and grow upwards while the sample indices of falling
+ * sync edges are stored as uint16_t at the end of the segment and grow
+ * downwards.
+ *
+ * Samples are int16, a little endian 10-bit bit stream, or for RAW40 the
+ * 40 byte raw packets without the sync word, 31 samples each.
+ *
+ * first_sample counts dropped packets too, so the host finds samples lost to
+ * overruns where it jumps by more than the previous segment's samples, and
+ * lost transfers where sequence skips.
+ *
+ * A sync edge entry holds the sample index in its low bits and the sweep
+ * profile starting at that edge in the top bits, see sweep_profile.h.
+ *
+ * STREAM_SEGMENT_TRIGGER is set in flags when the external trigger input was
+ * high in a packet captured since the previous segment was closed.
+ *
+ * gain_start and gain are the MCP4022 values at the first sample and at the
+ * end of the segment. When gain control stepped it within the segment,
+ * gain_sync is the sync edge entry the new gain took effect at and the
+ * sweep before that edge is transitional, see gain_control.h. At most one
+ * step takes effect per segment.
+ */
+#define STREAM_SAMPLES_PER_PACKET (31)
+#define STREAM_SYNC_SAMPLE_MASK (0x1FFF)
+#define STREAM_SYNC_PROFILE_SHIFT (13)
+#define STREAM_SEGMENT_TRIGGER (1 << 0)
+#define STREAM_GAIN_SYNC_NONE (0xFFFF)
+
+/* STREAM_FORMAT_INT16 and the samples of STREAM_FORMAT_RANGE can be
+ * decimated by a CIC filter, which leaves fractional bits in the samples:
+ * full scale grows from 512 to 16384. first_sample, samples and sync edge
+ * indices are all at the output rate.
+ */
+#define STREAM_DECIMATION_MAX (64)
+#define STREAM_DECIMATION_FRACTION_BITS (5)
+
+typedef struct {
+	uint16_t header_size;	/* Bytes, samples start after the header */
+	uint16_t format;	/* stream_format_t */
+	uint16_t samples;	/* Samples in the segment */
+	uint16_t syncs;		/* Sync edges at the end of the segment */
+	uint32_t sequence;	/* Segment number since capture started */
+	uint32_t first_sample;	/* Stream sample index of the first sample */
+	uint16_t profile;	/* Sweep profile at the first sample */
+	uint16_t flags;		/* STREAM_SEGMENT_* */
+	uint16_t gain_sync;	/* Sync edge entry of a gain step, or STREAM_GAIN_SYNC_NONE */
+	uint8_t gain;		/* MCP4022 value at the end of the segment */
+	uint8_t gain_start;	/* MCP4022 value at the first sample */
+} stream_segment_header_t;
+
+void stream_format_set(const stream_format_t new_format);
+stream_format_t stream_format(void);
+void stream_format_set_decimation(const uint_fast8_t factor_log2);
+uint32_t stream_format_next_sequence(void);
+uint16_t stream_format_segment_flags(void);
+void stream_format_reset(void);
+uint32_t stream_format_sync_edges(const uint32_t sync);
+void stream_format_packet(const uint32_t* const p);
+
+#endif/*__STREAM_FORMAT_H__*/
@@ -0,0 +1,137 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "sweep_profile.h"
+
+#include <libopencm3/lpc43xx/m4/nvic.h>
+
+typedef enum {
+	SWITCH_IDLE = 0,
+	SWITCH_DUE = 1,		/* Main loop writes the next profile */
+	SWITCH_WRITTEN = 2	/* Next profile starts at the next falling edge */
+} switch_state_t;
+
+static uint32_t table[SWEEP_PROFILE_COUNT][ADF4158_REGISTERS];
+static volatile uint8_t loaded;
+
+static volatile bool _ramp_sync;
+static volatile uint8_t requested = SWEEP_PROFILE_NONE;
+static volatile uint16_t sweeps_per_profile;
+
+static volatile uint8_t state = SWITCH_IDLE;
+static volatile uint8_t active;
+static volatile uint8_t next;
+static uint32_t sweeps;
+
+/* Registers as sent with usb_vendor_request_write_adf4158_image(), taking
+ * effect the next time the profile is selected */
+void sweep_profile_load(const uint_fast8_t profile, const uint32_t* const regs) {
+	for(uint_fast8_t reg=0; reg<ADF4158_REGISTERS; reg++) {
+		table[profile][reg] = regs[reg];
+	}
+	loaded |= 1 << profile;
+}
+
+/* Switch to profile, then cycle through the loaded profiles every sweeps
+ * sweeps if that is not 0. False if the profile was never loaded. */
+bool sweep_profile_select(const uint_fast8_t profile, const uint16_t sweeps) {
+	if( (profile >= SWEEP_PROFILE_COUNT) || !(loaded & (1 << profile)) ) {
+		return false;
+	}
+	sweeps_per_profile = sweeps;
+	requested = profile;
+	return true;
+}
+
+/* Called whenever capture starts or stops, ramp_sync tells whether capture
+ * calls sweep_profile_edge() */
+void sweep_profile_reset(const bool ramp_sync) {
+	if( state == SWITCH_WRITTEN ) {
+		active = next;
+		state = SWITCH_IDLE;
+	}
+	sweeps = 0;
+	_ramp_sync = ramp_sync;
+}
+
+static uint_fast8_t next_loaded(const uint_fast8_t profile) {
+	for(uint_fast8_t i=1; i<SWEEP_PROFILE_COUNT; i++) {
+		const uint_fast8_t p = (profile + i) % SWEEP_PROFILE_COUNT;
+		if( loaded & (1 << p) ) {
+			return p;
+		}
+	}
+	return profile;
+}
+
+/* Called by capture for every falling sync edge, which starts a sweep */
+void sweep_profile_edge(void) {
+	if( state == SWITCH_WRITTEN ) {
+		active = next;
+		state = SWITCH_IDLE;
+		sweeps = 0;
+		return;
+	}
+
+	sweeps++;
+	if( state != SWITCH_IDLE ) {
+		return;
+	}
+
+	if( requested != SWEEP_PROFILE_NONE ) {
+		next = requested;
+		requested = SWEEP_PROFILE_NONE;
+		state = SWITCH_DUE;
+	} else if( sweeps_per_profile && (sweeps >= sweeps_per_profile) ) {
+		next = next_loaded(active);
+		sweeps = 0;
+		if( next != active ) {
+			state = SWITCH_DUE;
+		}
+	}
+}
+
+/* Profile of the sweep in progress */
+uint_fast8_t sweep_profile_active(void) {
+	return active;
+}
+
+/* Write a pending switch to the ADF4158, called from the main loop */
+void sweep_profile_process(void) {
+	if( (state == SWITCH_IDLE) && !_ramp_sync && (requested != SWEEP_PROFILE_NONE) ) {
+		next = requested;
+		requested = SWEEP_PROFILE_NONE;
+		state = SWITCH_DUE;
+	}
+	if( state != SWITCH_DUE ) {
+		return;
+	}
+
+	// Vendor requests write the ADF4158 from the USB interrupt as well
+	nvic_disable_irq(NVIC_USB0_IRQ);
+	adf4158_write_image(table[next]);
+	if( _ramp_sync ) {
+		state = SWITCH_WRITTEN;
+	} else {
+		active = next;
+		state = SWITCH_IDLE;
+	}
+	nvic_enable_irq(NVIC_USB0_IRQ);
+}
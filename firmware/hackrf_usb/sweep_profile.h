@@ -0,0 +1,48 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __SWEEP_PROFILE_H__
+#define __SWEEP_PROFILE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rf_path.h"
+
+/* Table of ADF4158 register images loaded ahead of capture, so the sweep
+ * can change between frames without the host recomputing registers.
+ *
+ * While capture sees the sync edges, a switch waits for a falling edge (the
+ * end of a ramp on MUXOUT) and the main loop writes the new registers
+ * during the following sweep. That sweep is still tagged with the old
+ * profile and should be treated as transitional; the new profile is tagged
+ * from the next falling edge on. Otherwise a switch is written right away.
+ */
+#define SWEEP_PROFILE_COUNT (8)
+#define SWEEP_PROFILE_NONE (0xFF)
+
+void sweep_profile_load(const uint_fast8_t profile, const uint32_t* const regs);
+bool sweep_profile_select(const uint_fast8_t profile, const uint16_t sweeps);
+void sweep_profile_reset(const bool ramp_sync);
+void sweep_profile_edge(void);
+uint_fast8_t sweep_profile_active(void);
+void sweep_profile_process(void);
+
+#endif/*__SWEEP_PROFILE_H__*/
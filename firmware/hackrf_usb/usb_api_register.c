@@ -26,6 +26,8 @@
 
 #include <usb_queue.h>
 #include "rf_path.h"
+#include "sweep_profile.h"
+#include "gain_control.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -87,6 +89,64 @@ usb_request_status_t usb_vendor_request_write_adf4158(
     return USB_REQUEST_STATUS_OK;
 }
 
+static uint32_t adf4158_image[ADF4158_REGISTERS];
+
+usb_request_status_t usb_vendor_request_write_adf4158_image(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( endpoint->setup.length != sizeof(adf4158_image) ) {
+		return USB_REQUEST_STATUS_STALL;
+	}
+
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		usb_transfer_schedule_block(endpoint->out, &adf4158_image[0],
+				sizeof(adf4158_image), NULL, NULL);
+	} else if( stage == USB_TRANSFER_STAGE_DATA ) {
+		adf4158_write_image(adf4158_image);
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
+/* Same register image as usb_vendor_request_write_adf4158_image(), index is
+ * the profile */
+usb_request_status_t usb_vendor_request_load_sweep_profile(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	static uint32_t image[ADF4158_REGISTERS];
+
+	if( (endpoint->setup.length != sizeof(image))
+	    || (endpoint->setup.index >= SWEEP_PROFILE_COUNT) ) {
+		return USB_REQUEST_STATUS_STALL;
+	}
+
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		usb_transfer_schedule_block(endpoint->out, &image[0],
+				sizeof(image), NULL, NULL);
+	} else if( stage == USB_TRANSFER_STAGE_DATA ) {
+		sweep_profile_load(endpoint->setup.index, image);
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
+/* Value is the profile, index the sweeps before moving on to the next
+ * loaded profile, or 0 to stay on it */
+usb_request_status_t usb_vendor_request_select_sweep_profile(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		if( !sweep_profile_select(endpoint->setup.value, endpoint->setup.index) ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
 usb_request_status_t usb_vendor_request_read_adf4158(
 	usb_endpoint_t* const endpoint,
 	const usb_transfer_stage_t stage
@@ -111,7 +171,8 @@ usb_request_status_t usb_vendor_request_set_mcp(
     uint32_t data = endpoint->setup.index;
 
 	if( stage == USB_TRANSFER_STAGE_SETUP ) {
-        if (data > MCP_MAX_VALUE) {
+        // Gain control owns the MCP4022 while it runs
+        if (data > MCP_MAX_VALUE || gain_control_running()) {
 			return USB_REQUEST_STATUS_STALL;
         } else {
             mcp_set(data);
@@ -121,6 +182,29 @@ usb_request_status_t usb_vendor_request_set_mcp(
     return USB_REQUEST_STATUS_OK;
 }
 
+/* Data is a gain_control_config_t for the next capture */
+usb_request_status_t usb_vendor_request_set_gain_control(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+) {
+	static gain_control_config_t config;
+
+	if( endpoint->setup.length != sizeof(config) ) {
+		return USB_REQUEST_STATUS_STALL;
+	}
+
+	if( stage == USB_TRANSFER_STAGE_SETUP ) {
+		usb_transfer_schedule_block(endpoint->out, &config,
+				sizeof(config), NULL, NULL);
+	} else if( stage == USB_TRANSFER_STAGE_DATA ) {
+		if( !gain_control_configure(&config) ) {
+			return USB_REQUEST_STATUS_STALL;
+		}
+		usb_transfer_schedule_ack(endpoint->in);
+	}
+	return USB_REQUEST_STATUS_OK;
+}
+
 usb_request_status_t usb_vendor_request_set_gpio(
 	usb_endpoint_t* const endpoint,
 	const usb_transfer_stage_t stage
@@ -31,6 +31,21 @@ usb_request_status_t usb_vendor_request_write_adf4158(
 	const usb_transfer_stage_t stage
 );
 
+usb_request_status_t usb_vendor_request_write_adf4158_image(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+);
+
+usb_request_status_t usb_vendor_request_load_sweep_profile(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+);
+
+usb_request_status_t usb_vendor_request_select_sweep_profile(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+);
+
 usb_request_status_t usb_vendor_request_read_adf4158(
 	usb_endpoint_t* const endpoint,
 	const usb_transfer_stage_t stage
@@ -51,6 +66,11 @@ usb_request_status_t usb_vendor_request_set_mcp(
 	const usb_transfer_stage_t stage
 );
 
+usb_request_status_t usb_vendor_request_set_gain_control(
+	usb_endpoint_t* const endpoint,
+	const usb_transfer_stage_t stage
+);
+
 usb_request_status_t usb_vendor_request_set_clock(
     usb_endpoint_t* const endpoint,
 	const usb_transfer_stage_t stage
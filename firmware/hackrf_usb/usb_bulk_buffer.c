@@ -22,5 +22,92 @@
 
 #include "usb_bulk_buffer.h"
 
-const uint32_t usb_bulk_buffer_size = 32768;
+#include "usb_queue.h"
+#include "capture_stats.h"
+
+const uint32_t usb_bulk_buffer_size = USB_BULK_BUFFER_SIZE;
+
+volatile uint8_t usb_bulk_segment_state[USB_BULK_SEGMENT_COUNT];
 volatile uint32_t usb_bulk_buffer_offset = 0;
+volatile uint32_t usb_bulk_segment_end = USB_BULK_SEGMENT_SIZE;
+volatile bool usb_bulk_buffer_stalled = false;
+
+// Segment being filled and next segment to send
+static uint32_t fill_segment = 0;
+static uint32_t send_segment = 0;
+
+static void segment_open(void) {
+	usb_bulk_buffer_offset = fill_segment * USB_BULK_SEGMENT_SIZE;
+	usb_bulk_segment_end = usb_bulk_buffer_offset + USB_BULK_SEGMENT_SIZE;
+}
+
+/* Only call with the endpoint disabled and capture stopped */
+void usb_bulk_buffer_reset(void) {
+	for(uint32_t i=0; i<USB_BULK_SEGMENT_COUNT; i++) {
+		usb_bulk_segment_state[i] = USB_BULK_SEGMENT_FREE;
+	}
+	fill_segment = 0;
+	send_segment = 0;
+	usb_bulk_buffer_stalled = false;
+	segment_open();
+}
+
+uint32_t usb_bulk_segment_start(void) {
+	return fill_segment * USB_BULK_SEGMENT_SIZE;
+}
+
+/* Called by capture when the current segment is full */
+void usb_bulk_segment_complete(void) {
+	usb_bulk_segment_state[fill_segment] = USB_BULK_SEGMENT_READY;
+
+	if( ++fill_segment == USB_BULK_SEGMENT_COUNT ) {
+		fill_segment = 0;
+	}
+
+	if( usb_bulk_segment_state[fill_segment] == USB_BULK_SEGMENT_FREE ) {
+		segment_open();
+	} else {
+		usb_bulk_buffer_stalled = true;
+	}
+}
+
+/* Called by capture for every packet while stalled, returns false if the
+ * packet has to be dropped */
+bool usb_bulk_buffer_resume(void) {
+	if( usb_bulk_segment_state[fill_segment] != USB_BULK_SEGMENT_FREE ) {
+		capture_stats.overruns++;
+		return false;
+	}
+
+	usb_bulk_buffer_stalled = false;
+	segment_open();
+	return true;
+}
+
+static void segment_transfer_complete(void* user_data, unsigned int transferred) {
+	(void)transferred;
+	usb_bulk_segment_state[(uint32_t)user_data] = USB_BULK_SEGMENT_FREE;
+	capture_stats.transfers++;
+}
+
+/* Queue ready segments in order, called from the main loop */
+void usb_bulk_segment_schedule(const usb_endpoint_t* const endpoint) {
+	while( usb_bulk_segment_state[send_segment] == USB_BULK_SEGMENT_READY ) {
+		usb_bulk_segment_state[send_segment] = USB_BULK_SEGMENT_BUSY;
+		if( usb_transfer_schedule(
+				endpoint,
+				&usb_bulk_buffer[send_segment * USB_BULK_SEGMENT_SIZE],
+				USB_BULK_SEGMENT_SIZE,
+				segment_transfer_complete,
+				(void*)send_segment
+			) == -1 ) {
+			// Out of transfer descriptors, retry on the next pass
+			usb_bulk_segment_state[send_segment] = USB_BULK_SEGMENT_READY;
+			break;
+		}
+
+		if( ++send_segment == USB_BULK_SEGMENT_COUNT ) {
+			send_segment = 0;
+		}
+	}
+}
@@ -24,15 +24,50 @@
 #define __USB_BULK_BUFFER_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "usb_type.h"
+
+/* usb_bulk_buffer is a ring of segments, each sent as one USB transfer.
+ * Capture code fills one segment at a time and marks it ready, the main
+ * loop queues ready segments and transfer completion frees them again. When
+ * the next segment is still queued capture stalls and drops packets, which
+ * are counted in capture_stats.overruns.
+ *
+ * A segment holds exactly 128 raw packets and is a multiple of the 512 byte
+ * USB packet size, so transfers never end in a short packet. The ring is a
+ * whole number of segments and ram_usb in the ldscripts is sized to match.
+ */
+#define USB_BULK_SEGMENT_SIZE (5632)
+#define USB_BULK_SEGMENT_COUNT (11)
+#define USB_BULK_BUFFER_SIZE (USB_BULK_SEGMENT_COUNT * USB_BULK_SEGMENT_SIZE)
 
 /* Address of usb_bulk_buffer is set in ldscripts. If you change the name of this
  * variable, it won't be where it needs to be in the processor's address space,
  * unless you also adjust the ldscripts.
  */
-extern uint8_t usb_bulk_buffer[32768];
+extern uint8_t usb_bulk_buffer[USB_BULK_BUFFER_SIZE];
 
 extern const uint32_t usb_bulk_buffer_size;
 
+typedef enum {
+	USB_BULK_SEGMENT_FREE = 0,
+	USB_BULK_SEGMENT_READY = 1,
+	USB_BULK_SEGMENT_BUSY = 2
+} usb_bulk_segment_state_t;
+
+extern volatile uint8_t usb_bulk_segment_state[USB_BULK_SEGMENT_COUNT];
+
+/* Write offset and end of the segment being filled */
 extern volatile uint32_t usb_bulk_buffer_offset;
+extern volatile uint32_t usb_bulk_segment_end;
+
+extern volatile bool usb_bulk_buffer_stalled;
+
+void usb_bulk_buffer_reset(void);
+uint32_t usb_bulk_segment_start(void);
+void usb_bulk_segment_complete(void);
+bool usb_bulk_buffer_resume(void);
+void usb_bulk_segment_schedule(const usb_endpoint_t* const endpoint);
 
 #endif/*__USB_BULK_BUFFER_H__*/
@@ -25,6 +25,7 @@
 #include <usb_request.h>
 
 #include "usb_device.h"
+#include "usb_bulk_buffer.h"
 
 usb_endpoint_t usb_endpoint_control_out = {
 	.address = 0x00,
@@ -58,7 +59,7 @@ usb_endpoint_t usb_endpoint_bulk_in = {
 	.setup_complete = 0,
 	.transfer_complete = usb_queue_transfer_complete
 };
-static USB_DEFINE_QUEUE(usb_endpoint_bulk_in, 1);
+static USB_DEFINE_QUEUE(usb_endpoint_bulk_in, USB_BULK_SEGMENT_COUNT);
 
 usb_endpoint_t usb_endpoint_bulk_out = {
 	.address = 0x02,
@@ -21,10 +21,13 @@
  */
 
 #include <hackrf.h>
+#include "sink.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <time.h>
 
@@ -77,33 +80,148 @@ int gettimeofday(struct timeval *tv, void* ignored)
 #if defined(__GNUC__)
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #endif
 
 #include <signal.h>
 
 #define FILE_VERSION (1)
 
-#define FD_BUFFER_SIZE (8*1024)
-
 #define FREQ_ONE_MHZ (1000000ull)
 #define WRITE_BUFFER_SIZE (50*1024*1024)
-
-volatile static char fwrite_buffer[WRITE_BUFFER_SIZE];
-volatile static int fb_start = 0, fb_end = 0;
-pthread_mutex_t buf_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+#define WRITE_CHUNK_SIZE (4*1024*1024)
+
+#define DEVICES_MAX (8)
+
+// SCHED_FIFO priority of the transfer threads with -x
+#define REALTIME_PRIORITY_DEFAULT (50)
+
+// ADF4158 reference clock, the unit of the sweep delay
+#define REFERENCE_CLOCK (30e6)
+
+/* Multi-device captures are aligned on a sync edge at least ARM_DELAY
+ * seconds after the last board started. ALIGN_EDGES sync edges around that
+ * time are kept per board to choose from. */
+#define ARM_DELAY (0.5)
+#define ALIGN_EDGES (64)
+#define ALIGN_UNKNOWN (0xFFFFFFFFFFFFFFFFull)
+
+/* Gain control levels with -A, in sample magnitudes of full scale 512:
+ * sweeps with more than GAIN_CLIP_LIMIT samples at the top code step down,
+ * GAIN_HOLD sweeps in a row peaking below a quarter of full scale step up */
+#define GAIN_CLIP_LEVEL (508)
+#define GAIN_CLIP_LIMIT (8)
+#define GAIN_LOW_LEVEL (128)
+#define GAIN_HOLD (16)
+
+/* Capture windows, framed stream formats only. Without a trigger a single
+ * window is recorded from the start. With one the capture is armed, a
+ * window starts with the segment the trigger rises in, plus the retained
+ * segments up to pre_trigger_samples before it, and the capture re-arms
+ * when the window ends. Windows last window_samples, or window_sweeps
+ * counted from sync edges or range profiles. */
+typedef enum {
+    WINDOW_OFF = 0,
+    WINDOW_ARMED = 1,
+    WINDOW_RECORDING = 2,
+    WINDOW_DONE = 3,
+} window_state_t;
+
+typedef enum {
+    TRIGGER_NONE = 0,
+    TRIGGER_GPIO = 1,	// External trigger input of the board
+    TRIGGER_GATE = 2,	// Mean magnitude of a range gate in format 4
+} trigger_t;
+
+// Offset of the per-device align_sample array in a multi-device file header
+#define HEADER_ALIGN_OFFSET (4+4+4+ 8+8+8+8+4+4 +4+4)
+#define HEADER_INTERLEAVED (0xFFFFFFFF)
+
+/* One board of the capture: its device, the ring buffer between the
+ * libhackrf transfer thread and the writer thread, and the sync edges seen
+ * around the arm time. */
+typedef struct {
+    int index;
+    char* serial;
+    hackrf_device* device;
+    sink_t* sink;
+    char* fwrite_buffer;
+    volatile int fb_start, fb_end;
+    pthread_mutex_t writer_mutex;
+    pthread_cond_t cond;
+    volatile int thread_exit;
+    volatile int thread_done;
+    size_t bytes_to_xfer;
+
+    // Counters of the transfer and writer threads, under metrics_mutex
+    pthread_mutex_t metrics_mutex;
+    uint64_t received;	// Bytes delivered by the transfer callback
+    metrics_histogram_t callback_us;
+    uint32_t ring_high_water;	// Bytes
+    uint64_t written;	// Bytes handed to the sink
+    metrics_histogram_t write_us;
+    volatile uint32_t ring_full;	// Times the callback waited for room
+    // Main loop only
+    uint64_t received_last, written_last;
+
+    double start_time;
+    bool scanning;
+    uint8_t segment[HACKRF_STREAM_SEGMENT_SIZE];
+    int segment_fill;
+    uint64_t segment_sample;	// first_sample of the segment, extended past 32 bits
+    int edge_count;
+    uint64_t edge_sample[ALIGN_EDGES];
+    uint64_t align_sample;
+
+    window_state_t window;
+    uint32_t window_start;	// Stream sample the window started at
+    uint32_t window_edges;	// Sync edges or range profiles since then
+    uint32_t windows;	// Windows started
+    bool trigger_level;	// Trigger was on in the previous segment
+    uint8_t* pre_ring;	// Segments retained while armed
+    int pre_capacity, pre_next, pre_count;
+
+    bool tracking_gain;	// Following gain control steps in the segment headers
+    volatile int gain;	// MCP4022 value at the end of the last segment
+    uint64_t sweeps;	// Sync edges since the capture started
+    volatile uint32_t gain_steps;
+} capture_t;
+
+static capture_t captures[DEVICES_MAX];
+static int capture_count = 0;
+
+// Interleaved captures share one sink, written a record at a time
+static bool interleaved = false;
+pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define INTERLEAVE_PREFIX (8)
+
+// Writer chunks are a multiple of this, a segment for framed streams
+static int chunk_align = 1;
+
+static window_state_t window_mode = WINDOW_OFF;
+static trigger_t trigger = TRIGGER_NONE;
+static uint32_t window_samples;
+static uint32_t window_sweeps;
+static uint32_t pre_trigger_samples;
+static int gate_bins, gate_first, gate_last;
+static double gate_threshold;
+
+// Alignment timebase shared by all boards, in host seconds
+static double sample_period;
+static double sweep_period;
+static volatile double arm_time;
+static volatile bool armed = false;
 
 #if defined _WIN32
 	#define sleep(a) Sleep( (a*1000) )
 #endif
 
-static int buf_add(const uint8_t *s, int l) {
+static int buf_add(capture_t* c, const uint8_t *s, int l) {
     //Add l bytes to buffer,
     //returns number of bytes left over
     int left = l;
-    int fb = fb_end;
-    int start = fb_start;
+    int fb = c->fb_end;
+    int start = c->fb_start;
     while ( left > 0 ) {
         int fb_next = (fb + 1);
         if (fb_next >= WRITE_BUFFER_SIZE) {
@@ -111,66 +229,73 @@ static int buf_add(const uint8_t *s, int l) {
         }
         if (fb_next == start) {
             //Reached end, acquire mutex and check if reader has made more room
-            start = fb_start;
+            start = c->fb_start;
             //No more room, abort
             if (fb_next == start) {
                 return left;
             }
         }
-        fwrite_buffer[fb] = s[l-left];
+        c->fwrite_buffer[fb] = s[l-left];
         fb = fb_next;
         left--;
     }
-    fb_end = fb;
+    c->fb_end = fb;
     return left;
 }
 
-static int buf_size(void) {
-    int bytes = fb_end - fb_start;
+static int buf_size(capture_t* c) {
+    int bytes = c->fb_end - c->fb_start;
     if (bytes < 0) {
         bytes += WRITE_BUFFER_SIZE;
     }
     return bytes;
 }
 
-static int buf_get(uint8_t *dest, int max_bytes) {
-    //Get max_bytes bytes from the buffer
+static int buf_get(capture_t* c, uint8_t *dest, int max_bytes, int align) {
+    //Get max_bytes bytes from the buffer, a multiple of align
     //Returns number of bytes read
-    //pthread_mutex_lock(&buf_mutex);
-    int bytes = fb_end - fb_start;
+    int bytes = c->fb_end - c->fb_start;
     if (bytes < 0) {
         bytes += WRITE_BUFFER_SIZE;
     }
     if (bytes > max_bytes) {
         bytes = max_bytes;
     }
+    bytes -= bytes % align;
     int i = 0;
     while ( bytes > 0) {
-        dest[i++] = fwrite_buffer[fb_start];
-        fb_start = (fb_start + 1) % WRITE_BUFFER_SIZE;
+        dest[i++] = c->fwrite_buffer[c->fb_start];
+        c->fb_start = (c->fb_start + 1) % WRITE_BUFFER_SIZE;
         bytes--;
     }
     return i;
 }
 
-static int buf_init(void)
+static int buf_init(capture_t* c)
 {
     int ret = 0;
-    ret = pthread_cond_init(&cond, NULL);
+    c->fwrite_buffer = malloc(WRITE_BUFFER_SIZE);
+    if (!c->fwrite_buffer) {
+        return -1;
+    }
+    c->fb_start = 0;
+    c->fb_end = 0;
+
+    ret = pthread_cond_init(&c->cond, NULL);
     if (ret != 0) {
         return ret;
     }
 
-    ret = pthread_mutex_init(&buf_mutex, NULL);
+    ret = pthread_mutex_init(&c->writer_mutex, NULL);
     if (ret != 0) {
-        pthread_cond_destroy(&cond);
+        pthread_cond_destroy(&c->cond);
         return ret;
     }
 
-    ret = pthread_mutex_init(&writer_mutex, NULL);
+    ret = pthread_mutex_init(&c->metrics_mutex, NULL);
     if (ret != 0) {
-        pthread_cond_destroy(&cond);
-        pthread_mutex_destroy(&buf_mutex);
+        pthread_mutex_destroy(&c->writer_mutex);
+        pthread_cond_destroy(&c->cond);
         return ret;
     }
     return 0;
@@ -183,6 +308,13 @@ TimevalDiff(const struct timeval *a, const struct timeval *b)
    return (a->tv_sec - b->tv_sec) + 1e-6f * (a->tv_usec - b->tv_usec);
 }
 
+static double time_now_seconds(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
 int parse_u64(char* s, uint64_t* const value) {
 	uint_fast8_t base = 10;
 	char* s_end;
@@ -239,91 +371,404 @@ int parse_u32(char* s, uint32_t* const value) {
 
 volatile bool do_exit = false;
 
-FILE* fd = NULL;
-volatile uint32_t byte_count = 0;
-
 bool limit_num_samples = false;
-size_t bytes_to_xfer = 0;
 
 struct timeval time_start;
 struct timeval t_start;
 
-volatile int thread_exit = 0;
-volatile int thread_done = 0;
-
-static void write_header(FILE *fd, double sample_rate, double f0, double bw, double tsweep, int delay, int flags) {
+/* Multi-device files append the device count, this file's device index
+ * (HEADER_INTERLEAVED for an interleaved file) and the stream sample index
+ * of the common sync edge on every device, ALIGN_UNKNOWN until the capture
+ * ends. Interleaved files then hold records of a uint32 device index, a
+ * uint32 length and that many bytes of the device's stream.
+ */
+static int write_header(sink_t *sink, double sample_rate, double f0, double bw, double tsweep, int delay, int flags, uint32_t device_index) {
+    uint8_t header[SINK_HEADER_MAX];
     char magic[] = "FMCW";
     int version = FILE_VERSION;
     //magic, version, header size, sample_rate, f0, bw, tsweep, delay, flags
     int header_length = 4+4+4+ 8+8+8+8+4+4;
-    fwrite(magic, 1, 4, fd);
-    fwrite(&version, 4, 1, fd);
-    fwrite(&header_length, 4, 1, fd);
-    fwrite(&sample_rate, 8, 1, fd);
-    fwrite(&f0, 8, 1, fd);
-    fwrite(&bw, 8, 1, fd);
-    fwrite(&tsweep, 8, 1, fd);
-    fwrite(&delay, 4, 1, fd);
-    fwrite(&flags, 4, 1, fd);
+    if (capture_count > 1) {
+        header_length = HEADER_ALIGN_OFFSET + 8*capture_count;
+    }
+    memcpy(&header[0], magic, 4);
+    memcpy(&header[4], &version, 4);
+    memcpy(&header[8], &header_length, 4);
+    memcpy(&header[12], &sample_rate, 8);
+    memcpy(&header[20], &f0, 8);
+    memcpy(&header[28], &bw, 8);
+    memcpy(&header[36], &tsweep, 8);
+    memcpy(&header[44], &delay, 4);
+    memcpy(&header[48], &flags, 4);
+    if (capture_count > 1) {
+        uint32_t count = capture_count;
+        uint64_t align = ALIGN_UNKNOWN;
+        int i;
+        memcpy(&header[52], &count, 4);
+        memcpy(&header[56], &device_index, 4);
+        for (i = 0; i < capture_count; i++) {
+            memcpy(&header[HEADER_ALIGN_OFFSET + 8*i], &align, 8);
+        }
+    }
+    return sink_write_header(sink, header, header_length);
+}
+
+/* Fill in the align_sample array of a multi-device header */
+static void patch_header(sink_t *sink) {
+    uint64_t align[DEVICES_MAX];
+    int i;
+    for (i = 0; i < capture_count; i++) {
+        align[i] = captures[i].align_sample;
+    }
+    if (sink_patch_header(sink, HEADER_ALIGN_OFFSET, align, 8*capture_count) != 0) {
+        printf("Align samples not recorded in the stream header\n");
+    }
+}
+
+static void write_chunk(capture_t* c, uint8_t* record, int bytes) {
+    int result;
+    uint64_t start_us;
+    if (bytes == 0) {
+        return;
+    }
+    start_us = metrics_now_us();
+    if (interleaved) {
+        uint32_t prefix[2] = { c->index, bytes };
+        memcpy(record, prefix, INTERLEAVE_PREFIX);
+        pthread_mutex_lock(&file_mutex);
+        result = sink_write(c->sink, record, INTERLEAVE_PREFIX + bytes);
+        pthread_mutex_unlock(&file_mutex);
+    } else {
+        result = sink_write(c->sink, record + INTERLEAVE_PREFIX, bytes);
+    }
+
+    pthread_mutex_lock(&c->metrics_mutex);
+    metrics_histogram_add(&c->write_us, metrics_now_us() - start_us);
+    c->written += bytes;
+    pthread_mutex_unlock(&c->metrics_mutex);
+
+    if (result != 0) {
+        printf("Writing to the sink failed, stopping\n");
+        do_exit = true;
+    }
 }
 
+/* Chunks are whole segments of framed streams, so a sink that drops data
+ * drops whole segments. */
 static void* write_thread(void* arg) {
-    uint8_t *fd_buf = malloc(WRITE_BUFFER_SIZE);
-    if (!fd_buf) {
+    uint8_t *record = malloc(INTERLEAVE_PREFIX + WRITE_CHUNK_SIZE);
+    if (!record) {
         printf("malloc failed\n");
         return 0;
     }
+    uint8_t *fd_buf = record + INTERLEAVE_PREFIX;
     int bytes_to_write;
-    FILE *fout = (FILE*)arg;
-    int wrote;
-    while( !thread_exit ) {
-        pthread_mutex_lock(&writer_mutex);
+    capture_t *c = (capture_t*)arg;
+    while( !c->thread_exit ) {
+        pthread_mutex_lock(&c->writer_mutex);
         //Wait until we get something to write
-        while ( !(bytes_to_write = buf_get(fd_buf, WRITE_BUFFER_SIZE)) ) {
-            pthread_cond_wait(&cond, &writer_mutex);
-            if (thread_exit) {
+        while ( !(bytes_to_write = buf_get(c, fd_buf, WRITE_CHUNK_SIZE, chunk_align)) ) {
+            pthread_cond_wait(&c->cond, &c->writer_mutex);
+            if (c->thread_exit) {
                 break;
             }
         }
-        pthread_mutex_unlock(&writer_mutex);
-        int written = 0;
-        wrote = 0;
-        while (written < bytes_to_write) {
-            wrote = fwrite(&fd_buf[written], 1, bytes_to_write - wrote, fout);
-            written += wrote;
-        }
+        pthread_mutex_unlock(&c->writer_mutex);
+        write_chunk(c, record, bytes_to_write);
     }
-    thread_done = 1;
+    //Partial segment left when the capture stopped
+    write_chunk(c, record, buf_get(c, fd_buf, WRITE_CHUNK_SIZE, 1));
+    free(record);
+    c->thread_done = 1;
     pthread_exit(NULL);
     return 0;
 }
 
+/* Keep the sync edges of a whole segment that fall near the arm time */
+static void scan_segment(capture_t* c) {
+    hackrf_segment_header header;
+    int i;
+
+    memcpy(&header, c->segment, sizeof(header));
+    if (header.header_size < offsetof(hackrf_segment_header, profile)) {
+        // Firmware without sample counters
+        c->scanning = false;
+        return;
+    }
+    if (!armed) {
+        return;
+    }
+
+    for (i = 0; i < header.syncs; i++) {
+        uint16_t sync;
+        memcpy(&sync, &c->segment[HACKRF_STREAM_SEGMENT_SIZE - 2*(i+1)], 2);
+        const uint64_t sample = c->segment_sample + (sync & HACKRF_SYNC_SAMPLE_MASK);
+        if (c->start_time + sample * sample_period < arm_time - 2*sweep_period) {
+            continue;
+        }
+        c->edge_sample[c->edge_count++] = sample;
+        if (c->edge_count == ALIGN_EDGES) {
+            c->scanning = false;
+            return;
+        }
+    }
+}
+
+/* Pick the first edge of the first board after the arm time, then the edge
+ * nearest to it on every other board. Start times are only known to a
+ * control transfer or so, boards are expected to sweep in lockstep. */
+static void align_captures(void) {
+    capture_t* ref = &captures[0];
+    double ref_time = 0;
+    int i, j;
+
+    for (i = 0; i < capture_count; i++) {
+        captures[i].align_sample = ALIGN_UNKNOWN;
+    }
+    for (j = 0; j < ref->edge_count; j++) {
+        ref_time = ref->start_time + ref->edge_sample[j] * sample_period;
+        if (ref_time >= arm_time) {
+            ref->align_sample = ref->edge_sample[j];
+            break;
+        }
+    }
+    if (ref->align_sample == ALIGN_UNKNOWN) {
+        printf("No sync edge to align the devices on\n");
+        return;
+    }
+
+    for (i = 0; i < capture_count; i++) {
+        capture_t* c = &captures[i];
+        double best = sweep_period / 2;
+        for (j = 0; j < c->edge_count; j++) {
+            double skew = c->start_time + c->edge_sample[j] * sample_period - ref_time;
+            if (skew < 0) {
+                skew = -skew;
+            }
+            if (skew <= best) {
+                best = skew;
+                c->align_sample = c->edge_sample[j];
+            }
+        }
+        if (c->align_sample == ALIGN_UNKNOWN) {
+            printf("Device %d: no sync edge within half a sweep of device 0\n", i);
+        } else {
+            // What's left is host timing error, boards a sweep apart show up as
+            // a residual near half a sweep
+            printf("Device %d: aligned at sample %llu, residual alignment error %.0f us (%.2f sweeps)\n",
+                    i, (unsigned long long)c->align_sample, best * 1e6, best / sweep_period);
+            if (best > sweep_period / 4) {
+                printf("Device %d: residual is a large part of a sweep, alignment may be off by one\n", i);
+            }
+        }
+    }
+}
+
+/* Add everything to the ring, waiting for the writer when it's full */
+static void buf_write(capture_t* c, const uint8_t* s, int l) {
+    int left;
+    while ( (left = buf_add(c, s, l)) ) {
+        printf("Buffer full\n");
+        c->ring_full++;
+        s += l - left;
+        l = left;
+    }
+}
+
+/* Rising edge of the trigger, evaluated on every segment */
+static bool trigger_segment(capture_t* c, const hackrf_segment_header* header, const uint8_t* segment) {
+    bool level = false;
+
+    if (trigger == TRIGGER_GPIO) {
+        level = (header->flags & HACKRF_SEGMENT_TRIGGER) != 0;
+    } else if (trigger == TRIGGER_GATE) {
+        const int profiles = header->samples / gate_bins;
+        const float* values = (const float*)&segment[header->header_size];
+        int p, k;
+        for (p = 0; p < profiles && !level; p++) {
+            double sum = 0;
+            for (k = gate_first; k <= gate_last; k++) {
+                sum += values[p*gate_bins + k];
+            }
+            level = sum / (gate_last - gate_first + 1) > gate_threshold;
+        }
+    }
+
+    const bool rising = level && !c->trigger_level;
+    c->trigger_level = level;
+    return rising;
+}
+
+static void pre_store(capture_t* c, const uint8_t* segment) {
+    if (c->pre_capacity == 0) {
+        return;
+    }
+    memcpy(&c->pre_ring[c->pre_next * HACKRF_STREAM_SEGMENT_SIZE], segment, HACKRF_STREAM_SEGMENT_SIZE);
+    c->pre_next = (c->pre_next + 1) % c->pre_capacity;
+    if (c->pre_count < c->pre_capacity) {
+        c->pre_count++;
+    }
+}
+
+/* Write the retained segments that end after trigger - pre_trigger_samples */
+static void pre_flush(capture_t* c, uint32_t trigger_sample) {
+    const uint32_t start = trigger_sample - pre_trigger_samples;
+    int n;
+    for (n = c->pre_count; n > 0; n--) {
+        const uint8_t* segment = &c->pre_ring[((c->pre_next - n + c->pre_capacity) % c->pre_capacity) * HACKRF_STREAM_SEGMENT_SIZE];
+        hackrf_segment_header header;
+        memcpy(&header, segment, sizeof(header));
+        if ((int32_t)(header.first_sample + header.samples - start) > 0) {
+            buf_write(c, segment, HACKRF_STREAM_SEGMENT_SIZE);
+        }
+    }
+    c->pre_count = 0;
+}
+
+/* Report the gain steps recorded in the segment headers, at the sweep they
+ * took effect at, counted from the start of the capture */
+static void gain_segment(capture_t* c) {
+    hackrf_segment_header header;
+    memcpy(&header, c->segment, sizeof(header));
+
+    if (header.header_size < sizeof(header)) {
+        printf("Gain control needs firmware that records the gain in segments\n");
+        c->tracking_gain = false;
+        return;
+    }
+    // A step taking effect in segments that were lost
+    if (header.gain_start != c->gain) {
+        printf("[%d] Gain %d -> %u by sweep %llu\n", c->index, c->gain, header.gain_start,
+                (unsigned long long)c->sweeps);
+        c->gain = header.gain_start;
+        c->gain_steps++;
+    }
+    if (header.gain != c->gain) {
+        const uint64_t sweep = c->sweeps
+            + ((header.gain_sync != HACKRF_GAIN_SYNC_NONE) ? header.gain_sync : 0);
+        printf("[%d] Gain %d -> %u at sweep %llu\n", c->index, c->gain, header.gain,
+                (unsigned long long)sweep);
+        c->gain = header.gain;
+        c->gain_steps++;
+    }
+    c->sweeps += header.syncs;
+}
+
+/* Decide what happens to a whole segment of a windowed capture */
+static void window_segment(capture_t* c) {
+    hackrf_segment_header header;
+    memcpy(&header, c->segment, sizeof(header));
+
+    if (header.header_size < offsetof(hackrf_segment_header, gain_sync)) {
+        printf("Capture windows need firmware with sample counters and segment flags\n");
+        c->window = WINDOW_DONE;
+        return;
+    }
+    const bool fired = trigger_segment(c, &header, c->segment);
+
+    switch (c->window) {
+    case WINDOW_ARMED:
+        if (!fired) {
+            pre_store(c, c->segment);
+            return;
+        }
+        c->window = WINDOW_RECORDING;
+        c->window_start = header.first_sample;
+        c->window_edges = 0;
+        c->windows++;
+        printf("[%d] Trigger %u at sample %u\n", c->index, c->windows, header.first_sample);
+        pre_flush(c, header.first_sample);
+        // Fall through - the trigger segment is the first of the window
+    case WINDOW_RECORDING:
+        buf_write(c, c->segment, HACKRF_STREAM_SEGMENT_SIZE);
+        if (header.format == HACKRF_STREAM_FORMAT_RANGE) {
+            c->window_edges += header.samples / gate_bins;
+        } else {
+            c->window_edges += header.syncs;
+        }
+        // N sweeps of samples lie between N + 1 sync edges
+        if (window_sweeps
+                ? c->window_edges >= window_sweeps + (header.format != HACKRF_STREAM_FORMAT_RANGE)
+                : (uint32_t)(header.first_sample + header.samples - c->window_start) >= window_samples) {
+            c->window = (trigger == TRIGGER_NONE) ? WINDOW_DONE : WINDOW_ARMED;
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+/* Reassemble segments for alignment and capture windows */
+static void stream_segments(capture_t* c, const uint8_t* data, int length) {
+    while ((c->scanning || c->window != WINDOW_OFF || c->tracking_gain) && length > 0) {
+        int n = HACKRF_STREAM_SEGMENT_SIZE - c->segment_fill;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(&c->segment[c->segment_fill], data, n);
+        c->segment_fill += n;
+        data += n;
+        length -= n;
+        if (c->segment_fill == HACKRF_STREAM_SEGMENT_SIZE) {
+            uint32_t first_sample;
+            memcpy(&first_sample, &c->segment[offsetof(hackrf_segment_header, first_sample)], 4);
+            // first_sample wraps every 2^32 samples, segments come in order
+            c->segment_sample += (uint32_t)(first_sample - (uint32_t)c->segment_sample);
+            c->segment_fill = 0;
+            if (c->scanning) {
+                scan_segment(c);
+            }
+            if (c->tracking_gain) {
+                gain_segment(c);
+            }
+            if (c->window != WINDOW_OFF) {
+                window_segment(c);
+            }
+        }
+    }
+}
+
 int rx_callback(hackrf_transfer* transfer) {
+	capture_t* c = (capture_t*)transfer->rx_ctx;
 	size_t bytes_to_write;
+	const uint64_t start_us = metrics_now_us();
+	uint32_t ring_used;
 
-	if( fd != NULL )
+	if( c->sink != NULL )
 	{
-		ssize_t bytes_left;
-		byte_count += transfer->valid_length;
 		bytes_to_write = transfer->valid_length;
 		if (limit_num_samples) {
-			if (bytes_to_write >= bytes_to_xfer) {
-				bytes_to_write = bytes_to_xfer;
+			if (bytes_to_write >= c->bytes_to_xfer) {
+				bytes_to_write = c->bytes_to_xfer;
 			}
-			bytes_to_xfer -= bytes_to_write;
+			c->bytes_to_xfer -= bytes_to_write;
 		}
 
-        while ( (bytes_left = buf_add(transfer->buffer, bytes_to_write)) ) {
-            printf("Buffer full\n");
+        if (c->window == WINDOW_OFF) {
+            stream_segments(c, transfer->buffer, bytes_to_write);
+            buf_write(c, transfer->buffer, bytes_to_write);
+        } else {
+            // Windows add whole segments to the ring themselves
+            stream_segments(c, transfer->buffer, bytes_to_write);
         }
 
         //Signal to writer
-        pthread_mutex_lock(&writer_mutex);
-        pthread_cond_signal(&cond);
-        pthread_mutex_unlock(&writer_mutex);
+        pthread_mutex_lock(&c->writer_mutex);
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->writer_mutex);
+
+        ring_used = buf_size(c);
+        pthread_mutex_lock(&c->metrics_mutex);
+        c->received += transfer->valid_length;
+        if (ring_used > c->ring_high_water) {
+            c->ring_high_water = ring_used;
+        }
+        metrics_histogram_add(&c->callback_us, metrics_now_us() - start_us);
+        pthread_mutex_unlock(&c->metrics_mutex);
 
-        if ((bytes_left != 0)
-                || (limit_num_samples && (bytes_to_xfer == 0))) {
+        if ((c->window == WINDOW_DONE)
+                || (limit_num_samples && (c->bytes_to_xfer == 0))) {
             return -1;
         } else {
             return 0;
@@ -333,19 +778,102 @@ int rx_callback(hackrf_transfer* transfer) {
 	}
 }
 
+typedef struct {
+    uint64_t received;
+    uint64_t written;
+    uint32_t ring_high_water;
+    metrics_histogram_t callback_us;
+    metrics_histogram_t write_us;
+} capture_snapshot_t;
+
+static void capture_snapshot(capture_t* c, capture_snapshot_t* snapshot) {
+    pthread_mutex_lock(&c->metrics_mutex);
+    snapshot->received = c->received;
+    snapshot->written = c->written;
+    snapshot->ring_high_water = c->ring_high_water;
+    snapshot->callback_us = c->callback_us;
+    snapshot->write_us = c->write_us;
+    pthread_mutex_unlock(&c->metrics_mutex);
+}
+
+/* One board in a metrics line, counters are totals since the start and
+ * rates over the last interval. stats and gaps are NULL when unavailable. */
+static void metrics_capture(metrics_t* m, capture_t* c, const capture_snapshot_t* snapshot,
+        double interval, const hackrf_stats* stats, const hackrf_gap_stats* gaps) {
+    const bool owns_sink = !(c->index > 0 && interleaved);
+
+    metrics_printf(m, "{\"index\":%d", c->index);
+    if (c->serial != NULL) {
+        metrics_printf(m, ",\"serial\":\"%s\"", c->serial);
+    }
+    metrics_printf(m, ",\"bytes\":%llu,\"bytes_per_second\":%.0f,",
+            (unsigned long long)snapshot->received,
+            (snapshot->received - c->received_last) / interval);
+    metrics_histogram_print(m, "callback", &snapshot->callback_us);
+    metrics_printf(m, ",\"ring\":{\"size\":%d,\"used\":%d,\"high_water\":%u,\"full\":%u}",
+            WRITE_BUFFER_SIZE, buf_size(c), snapshot->ring_high_water, c->ring_full);
+    metrics_printf(m, ",\"sink\":{\"bytes\":%llu,\"bytes_per_second\":%.0f,",
+            (unsigned long long)snapshot->written,
+            (snapshot->written - c->written_last) / interval);
+    metrics_histogram_print(m, "write", &snapshot->write_us);
+    if (owns_sink) {
+        metrics_printf(m, ",\"dropped\":%llu,\"parts\":%u",
+                (unsigned long long)sink_dropped(c->sink), sink_parts(c->sink));
+    }
+    metrics_printf(m, "}");
+    if (stats != NULL) {
+        metrics_printf(m, ",\"firmware\":{\"interrupts\":%u,\"packets\":%u,\"overruns\":%u,"
+                "\"transfers\":%u,", stats->interrupts, stats->packets, stats->overruns, stats->transfers);
+        if (stats->sync_edges == HACKRF_STATS_UNAVAILABLE) {
+            metrics_printf(m, "\"sync_edges\":null,");
+        } else {
+            metrics_printf(m, "\"sync_edges\":%u,", stats->sync_edges);
+        }
+        metrics_printf(m, "\"isr_cycles_max\":%u,\"isr_interval_max\":%u,\"dma_errors\":%u}",
+                stats->isr_cycles_max, stats->isr_interval_max, stats->dma_errors);
+    }
+    if (gaps != NULL) {
+        metrics_printf(m, ",\"gaps\":{\"gaps\":%u,\"lost_segments\":%u,\"lost_samples\":%llu}",
+                gaps->gaps, gaps->lost_segments, (unsigned long long)gaps->lost_samples);
+    }
+    if (c->tracking_gain) {
+        metrics_printf(m, ",\"gain\":%d,\"gain_steps\":%u", c->gain, c->gain_steps);
+    }
+    if (window_mode == WINDOW_ARMED) {
+        metrics_printf(m, ",\"windows\":%u,\"recording\":%s",
+                c->windows, (c->window == WINDOW_RECORDING) ? "true" : "false");
+    }
+    metrics_printf(m, "}");
+}
+
 static void usage() {
 	printf("Usage:\n");
-	printf("\t-r <filename> # Receive data into file.\n");
+	printf("\t-r <sink> # Receive data into a file or: - (stdout), pipe:<path>, shm:<name>[:MiB],\n\t                # udp:<host>:<port>, tcp:<host>:<port>. Append ,block or ,drop to set backpressure.\n");
 	printf("\t[-f freq_hz] # Sweep start frequency in Hz.\n");
 	printf("\t[-b freq_hz] # Sweep bandwidth in Hz.\n");
 	printf("\t[-t seconds] # Sweep length in seconds\n");
 	printf("\t[-g 0<=x<=63] # MCP4022 gain setting.\n");
+	printf("\t[-A min:max[:step]] # Gain control in the device, starting from -g (formats 1 - 3).\n");
 	printf("\t[-c x] # ADC clock divider. ADC clock = 204e6/(2*x).\n");
 	printf("\t[-d clks] # Sweep delay in refernce clock cycles (Default 30 MHz)\n");
+	printf("\t[-m mode] # Capture mode: 0 = SGPIO interrupt (default), 1 = GPDMA, 2 = M0 core.\n");
+	printf("\t[-p format] # Stream format: 0 = raw SGPIO packets (default), 1 = int16, 2 = packed 10-bit,\n\t                # 3 = raw packets with sync edges as sample indices, 4 = range profiles.\n");
+	printf("\t[-n bins] # Range bins per sweep in format 4, up to 512 (default 128).\n");
+	printf("\t[-k factor] # Decimate formats 1 and 4 in the device by 1 (default), 2, 4, ... 64.\n\t                # Format 4 transforms at most %d samples of each sweep, and picks the\n\t                # smallest factor that fits the sweep unless -k is given.\n", HACKRF_RANGE_FFT_SIZE);
+	printf("\t[-z] # Zero-fill samples lost from formats 1 - 3 to keep them aligned.\n");
+	printf("\t[-s serial] # Open the board with this serial number (suffix), repeat for up to %d boards.\n", DEVICES_MAX);
+	printf("\t[-a] # Open every connected board.\n");
+	printf("\t[-i] # Write several boards to one interleaved sink instead of <sink>.<n>.\n");
+	printf("\t[-w seconds] # Record a window of this length, then stop or re-arm the trigger.\n");
+	printf("\t[-S sweeps] # Record a window of this many sweeps, counted from sync edges (formats 1 - 4).\n");
+	printf("\t[-T trigger] # Start windows on: gpio (external trigger input on P2_11), or\n\t                # gate:<first bin>:<last bin>:<threshold> (mean range bin magnitude, format 4).\n");
+	printf("\t[-P seconds] # Keep this much of the stream from before the trigger.\n");
+	printf("\t[-R MiB] # Split a file sink into parts <file>.NNNN of this size, each with the header.\n");
+	printf("\t[-L seconds] # Split a file sink into parts of this duration.\n");
+	printf("\t[-M metrics] # JSON line a second with rates, latency histograms, ring and firmware counters,\n\t                # to a file or unix:<socket path>.\n");
+	printf("\t[-x cpu[:priority]] # Real-time transfer threads: pinned to cpu (+1 per board, -1 for any),\n\t                # SCHED_FIFO priority (default %d), locked buffers, private libusb contexts.\n", REALTIME_PRIORITY_DEFAULT);
 }
 
-static hackrf_device* device = NULL;
-
 #ifdef _MSC_VER
 BOOL WINAPI
 sighandler(int signum)
@@ -375,6 +903,7 @@ int main(int argc, char** argv) {
 	int exit_code = EXIT_SUCCESS;
 	struct timeval t_end;
 	float time_diff;
+	int i;
 
     /* Default parameters */
     double f0 = 5.6e9;
@@ -383,8 +912,26 @@ int main(int argc, char** argv) {
     int delay = 1800;
     int mcp_gain = 0;
     int clk_divider = 20;
-
-	while( (opt = getopt(argc, argv, "b:d:f:t:r:g:c:")) != EOF )
+    int capture_mode = HACKRF_CAPTURE_MODE_ISR;
+    int stream_format = HACKRF_STREAM_FORMAT_RAW;
+    int decimation = 1;
+    bool decimation_set = false;
+    int range_bins = 128;
+    bool gap_fill = false;
+    hackrf_gain_control gain_control = { 0, 0, 63, 1, GAIN_CLIP_LEVEL, GAIN_CLIP_LIMIT, GAIN_LOW_LEVEL, GAIN_HOLD };
+    bool all_devices = false;
+    bool realtime = false;
+    double window_seconds = 0;
+    double pre_trigger_seconds = 0;
+    hackrf_transfer_options transfer_options;
+    sink_options_t sink_options = { 0, 0 };
+    const char* metrics_spec = NULL;
+    metrics_t* metrics = NULL;
+    hackrf_stats final_stats[DEVICES_MAX];
+    bool final_have_stats[DEVICES_MAX];
+    hackrf_gap_stats final_gaps[DEVICES_MAX];
+
+	while( (opt = getopt(argc, argv, "b:d:f:t:r:g:A:c:m:p:k:n:zs:aix:w:S:T:P:R:L:M:")) != EOF )
 	{
 		result = HACKRF_SUCCESS;
 		switch( opt )
@@ -429,6 +976,21 @@ int main(int argc, char** argv) {
             }
 			break;
 
+		case 'A':
+            {
+                unsigned int gain_min, gain_max, step = 1;
+                if (sscanf(optarg, "%u:%u:%u", &gain_min, &gain_max, &step) < 2
+                        || gain_min > gain_max || gain_max > 63 || step == 0 || step > 63) {
+                    result = HACKRF_ERROR_INVALID_PARAM;
+                } else {
+                    gain_control.enable = 1;
+                    gain_control.gain_min = gain_min;
+                    gain_control.gain_max = gain_max;
+                    gain_control.step = step;
+                }
+            }
+			break;
+
 		case 'c':
             clk_divider = (int)strtol(optarg, (char **)NULL, 10);
             if (clk_divider <= 0) {
@@ -436,6 +998,124 @@ int main(int argc, char** argv) {
             }
 			break;
 
+		case 'm':
+            capture_mode = (int)strtol(optarg, (char **)NULL, 10);
+            if (capture_mode < HACKRF_CAPTURE_MODE_ISR || capture_mode > HACKRF_CAPTURE_MODE_M0) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'p':
+            stream_format = (int)strtol(optarg, (char **)NULL, 10);
+            if (stream_format < HACKRF_STREAM_FORMAT_RAW || stream_format > HACKRF_STREAM_FORMAT_RANGE) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'k':
+            decimation = (int)strtol(optarg, (char **)NULL, 10);
+            if (decimation <= 0 || decimation > HACKRF_DECIMATION_MAX || (decimation & (decimation - 1))) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+            decimation_set = true;
+			break;
+
+		case 'n':
+            range_bins = (int)strtol(optarg, (char **)NULL, 10);
+            if (range_bins <= 0 || range_bins > HACKRF_RANGE_BINS_MAX) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'z':
+			gap_fill = true;
+			break;
+
+		case 's':
+            if (capture_count == DEVICES_MAX) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            } else {
+                captures[capture_count++].serial = optarg;
+            }
+			break;
+
+		case 'a':
+			all_devices = true;
+			break;
+
+		case 'i':
+			interleaved = true;
+			break;
+
+		case 'w':
+			window_seconds = atof(optarg);
+            if (window_seconds <= 0) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'S':
+			result = parse_u32(optarg, &window_sweeps);
+            if (window_sweeps == 0) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'T':
+            if (strcmp(optarg, "gpio") == 0) {
+                trigger = TRIGGER_GPIO;
+            } else if (sscanf(optarg, "gate:%d:%d:%lf", &gate_first, &gate_last, &gate_threshold) == 3
+                    && gate_first >= 0 && gate_last >= gate_first) {
+                trigger = TRIGGER_GATE;
+            } else {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'P':
+			pre_trigger_seconds = atof(optarg);
+            if (pre_trigger_seconds <= 0) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'R':
+            {
+                uint32_t mib = 0;
+                result = parse_u32(optarg, &mib);
+                sink_options.rotate_bytes = (uint64_t)mib << 20;
+                if (mib == 0) {
+                    result = HACKRF_ERROR_INVALID_PARAM;
+                }
+            }
+			break;
+
+		case 'L':
+			sink_options.rotate_seconds = atof(optarg);
+            if (sink_options.rotate_seconds <= 0) {
+                result = HACKRF_ERROR_INVALID_PARAM;
+            }
+			break;
+
+		case 'M':
+			metrics_spec = optarg;
+			break;
+
+		case 'x':
+            {
+                char* priority;
+                realtime = true;
+                transfer_options.cpu = (int)strtol(optarg, &priority, 10);
+                transfer_options.priority = REALTIME_PRIORITY_DEFAULT;
+                if (*priority == ':') {
+                    transfer_options.priority = (int)strtol(priority + 1, (char **)NULL, 10);
+                }
+                if (transfer_options.cpu < -1 || transfer_options.priority < 0) {
+                    result = HACKRF_ERROR_INVALID_PARAM;
+                }
+            }
+			break;
+
 		default:
 			printf("unknown argument '-%c %s'\n", opt, optarg);
 			usage();
@@ -456,12 +1136,6 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
 	}
 
-    //Create thread for writing to file
-    if (buf_init()) {
-        printf("buf_init failed\n");
-        return -1;
-    }
-
 	result = hackrf_init();
 	if( result != HACKRF_SUCCESS ) {
 		printf("hackrf_init() failed: %s (%d)\n", hackrf_error_name(result), result);
@@ -469,38 +1143,94 @@ int main(int argc, char** argv) {
 		return EXIT_FAILURE;
 	}
 
-	result = hackrf_open_by_serial(NULL, &device);
-	if( result != HACKRF_SUCCESS ) {
-		printf("hackrf_open() failed: %s (%d)\n", hackrf_error_name(result), result);
-		usage();
-		return EXIT_FAILURE;
-	}
-
-    fd = fopen(path, "wb");
-    if( fd == NULL ) {
-        printf("Failed to open file: %s\n", path);
-        return EXIT_FAILURE;
+    if (all_devices) {
+        hackrf_device_list_t* list = hackrf_device_list();
+        if (list == NULL) {
+            printf("hackrf_device_list() failed\n");
+            return EXIT_FAILURE;
+        }
+        capture_count = 0;
+        for (i = 0; i < list->devicecount && capture_count < DEVICES_MAX; i++) {
+            if (list->serial_numbers[i]) {
+                captures[capture_count++].serial = strdup(list->serial_numbers[i]);
+            }
+        }
+        hackrf_device_list_free(list);
+        if (capture_count == 0) {
+            printf("No boards found\n");
+            return EXIT_FAILURE;
+        }
+    } else if (capture_count == 0) {
+        // First board found
+        captures[capture_count++].serial = NULL;
     }
 
-    /* Change fd buffer to have bigger one to store or read data on/to HDD */
-    result = setvbuf(fd , NULL , _IOFBF , FD_BUFFER_SIZE);
-    if( result != 0 ) {
-        printf("setvbuf() failed: %d\n", result);
-        usage();
-        return EXIT_FAILURE;
+    if (interleaved && capture_count == 1) {
+        interleaved = false;
     }
 
-    pthread_t writer;
-    pthread_attr_t attr;
+    // Before anything else is printed, stdout may become the data stream
+    for (i = 0; i < capture_count; i++) {
+        capture_t* c = &captures[i];
+        char spec[PATH_FILE_MAX_LEN];
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (i > 0 && interleaved) {
+            c->sink = captures[0].sink;
+            continue;
+        }
 
-    if (pthread_create(&writer, &attr, write_thread, fd)) {
-        printf("pthread_create failed\n");
-        return -1;
+        if (capture_count > 1 && !interleaved) {
+            if (sink_device_spec(spec, sizeof(spec), path, i) != 0) {
+                printf("%s can't be split per board, use -i\n", path);
+                return EXIT_FAILURE;
+            }
+        } else {
+            snprintf(spec, sizeof(spec), "%s", path);
+        }
+        c->sink = sink_open(spec, &sink_options);
+        if( c->sink == NULL ) {
+            printf("Failed to open sink: %s\n", spec);
+            return EXIT_FAILURE;
+        }
+        printf("Writing to %s, %s when behind\n", spec, sink_policy_name(c->sink));
+    }
+    if (metrics_spec != NULL) {
+        metrics = metrics_open(metrics_spec);
+        if (metrics == NULL) {
+            printf("Failed to open metrics output: %s\n", metrics_spec);
+            return EXIT_FAILURE;
+        }
+    }
+    if (stream_format != HACKRF_STREAM_FORMAT_RAW) {
+        chunk_align = HACKRF_STREAM_SEGMENT_SIZE;
+    }
+    if (capture_count > 1 && (stream_format == HACKRF_STREAM_FORMAT_RAW
+            || stream_format == HACKRF_STREAM_FORMAT_RANGE)) {
+        printf("Boards can only be aligned in stream formats 1 - 3, recording without alignment\n");
     }
 
+    for (i = 0; i < capture_count; i++) {
+        capture_t* c = &captures[i];
+        c->index = i;
+        c->scanning = (capture_count > 1)
+            && (stream_format != HACKRF_STREAM_FORMAT_RAW)
+            && (stream_format != HACKRF_STREAM_FORMAT_RANGE);
+        c->align_sample = ALIGN_UNKNOWN;
+        c->tracking_gain = gain_control.enable;
+        c->gain = mcp_gain;
+
+        if (buf_init(c)) {
+            printf("buf_init failed\n");
+            return -1;
+        }
+
+        result = hackrf_open_by_serial(c->serial, &c->device);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_open() failed: %s (%d)\n", hackrf_error_name(result), result);
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
 
 #ifdef _MSC_VER
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
@@ -513,110 +1243,422 @@ int main(int argc, char** argv) {
 	signal(SIGABRT, &sigint_callback_handler);
 #endif
 
-    result = hackrf_set_mcp(device, mcp_gain);
-	if( result != HACKRF_SUCCESS ) {
-		printf("hackrf_set_mcp() failed: %s (%d)\n", hackrf_error_name(result), result);
-		return EXIT_FAILURE;
-	}
+    if (decimation > 1 && stream_format != HACKRF_STREAM_FORMAT_INT16
+            && stream_format != HACKRF_STREAM_FORMAT_RANGE) {
+        printf("Decimation needs the int16 or range stream format (-p 1 or 4)\n");
+        return EXIT_FAILURE;
+    }
+    if (stream_format == HACKRF_STREAM_FORMAT_RANGE) {
+        // Samples past the FFT size are cut off the end of each sweep
+        const double sweep_samples = 204e6/(2*clk_divider) * tsweep;
+        while (!decimation_set && decimation < HACKRF_DECIMATION_MAX
+                && sweep_samples / decimation > HACKRF_RANGE_FFT_SIZE) {
+            decimation *= 2;
+        }
+        if (sweep_samples / decimation > HACKRF_RANGE_FFT_SIZE) {
+            printf("Sweeps are %.0f samples, range profiles only use the first %d, raise -k or -c\n",
+                    sweep_samples / decimation, HACKRF_RANGE_FFT_SIZE);
+        } else if (decimation > 1 && !decimation_set) {
+            printf("Decimating by %d to fit sweeps in the range FFT\n", decimation);
+        }
+    }
 
-    result = hackrf_set_sweep(device, f0, bw, tsweep, delay);
-	if( result != HACKRF_SUCCESS ) {
-		printf("hackrf_set_sweep() failed: %s (%d)\n", hackrf_error_name(result), result);
-		return EXIT_FAILURE;
-	}
+    if (window_seconds > 0 && window_sweeps > 0) {
+        printf("A window is either seconds (-w) or sweeps (-S)\n");
+        return EXIT_FAILURE;
+    }
+    if ((trigger != TRIGGER_NONE || pre_trigger_seconds > 0) && window_seconds == 0 && window_sweeps == 0) {
+        printf("A trigger needs a window length (-w or -S)\n");
+        return EXIT_FAILURE;
+    }
+    if (pre_trigger_seconds > 0 && trigger == TRIGGER_NONE) {
+        printf("Pre-trigger retention needs a trigger (-T)\n");
+        return EXIT_FAILURE;
+    }
+    if (stream_format == HACKRF_STREAM_FORMAT_RAW && (window_sweeps > 0 || trigger != TRIGGER_NONE)) {
+        printf("Sweep counts and triggers need a framed stream format (-p 1 - 4)\n");
+        return EXIT_FAILURE;
+    }
+    if (gain_control.enable && (stream_format == HACKRF_STREAM_FORMAT_RAW
+            || stream_format == HACKRF_STREAM_FORMAT_RANGE)) {
+        printf("Gain control needs a stream format of samples (-p 1 - 3)\n");
+        return EXIT_FAILURE;
+    }
+    if (trigger == TRIGGER_GATE && (stream_format != HACKRF_STREAM_FORMAT_RANGE || gate_last >= range_bins)) {
+        printf("A range gate trigger needs range profiles (-p 4) and a gate within the range bins\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < capture_count; i++) {
+        hackrf_device* device = captures[i].device;
+
+        result = hackrf_set_mcp(device, mcp_gain);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_set_mcp() failed: %s (%d)\n", hackrf_error_name(result), result);
+            return EXIT_FAILURE;
+        }
+
+        if (gain_control.enable) {
+            result = hackrf_set_gain_control(device, &gain_control);
+            if( result != HACKRF_SUCCESS ) {
+                printf("hackrf_set_gain_control() failed: %s (%d)\n", hackrf_error_name(result), result);
+                return EXIT_FAILURE;
+            }
+        }
+
+        result = hackrf_set_capture_mode(device, capture_mode);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_set_capture_mode() failed: %s (%d)\n", hackrf_error_name(result), result);
+            return EXIT_FAILURE;
+        }
+
+        result = hackrf_set_stream_format(device, stream_format);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_set_stream_format() failed: %s (%d)\n", hackrf_error_name(result), result);
+            return EXIT_FAILURE;
+        }
+        hackrf_set_gap_fill(device, gap_fill);
+
+        result = hackrf_set_decimation(device, decimation);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_set_decimation() failed: %s (%d)\n", hackrf_error_name(result), result);
+            return EXIT_FAILURE;
+        }
+
+        if (stream_format == HACKRF_STREAM_FORMAT_RANGE) {
+            result = hackrf_set_range_bins(device, range_bins);
+            if( result != HACKRF_SUCCESS ) {
+                printf("hackrf_set_range_bins() failed: %s (%d)\n", hackrf_error_name(result), result);
+                return EXIT_FAILURE;
+            }
+        }
+
+        result = hackrf_set_sweep(device, f0, bw, tsweep, delay);
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_set_sweep() failed: %s (%d)\n", hackrf_error_name(result), result);
+            return EXIT_FAILURE;
+        }
+
+        result = hackrf_set_clock_divider(device, clk_divider);
+
+        if (realtime) {
+            hackrf_transfer_options options = transfer_options;
+            options.lock_buffers = true;
+            options.private_context = true;
+            if (options.cpu >= 0) {
+                options.cpu += i;
+            }
+            result = hackrf_set_transfer_options(device, &options);
+            if( result != HACKRF_SUCCESS ) {
+                printf("hackrf_set_transfer_options() failed: %s (%d)\n", hackrf_error_name(result), result);
+                return EXIT_FAILURE;
+            }
+#if defined(__GNUC__)
+            if (mlock(captures[i].fwrite_buffer, WRITE_BUFFER_SIZE) != 0) {
+                printf("mlock() of the write buffer failed, continuing without\n");
+            }
+#endif
+        }
+    }
 
     double sample_rate = 204e6/(2*clk_divider);
-    result = hackrf_set_clock_divider(device, clk_divider);
-    write_header(fd, sample_rate, f0, bw, tsweep, delay, 0);
+    // Rate of the samples in the file
+    sample_rate /= decimation;
+    sample_period = 1.0 / sample_rate;
+    sweep_period = tsweep + delay / REFERENCE_CLOCK;
+
+    if (stream_format == HACKRF_STREAM_FORMAT_RAW && window_seconds > 0) {
+        // Raw packets are 44 bytes for 31 samples
+        const size_t packets = (size_t)(window_seconds * sample_rate / 31);
+        limit_num_samples = true;
+        for (i = 0; i < capture_count; i++) {
+            captures[i].bytes_to_xfer = packets * 44;
+        }
+    } else if (window_seconds > 0 || window_sweeps > 0) {
+        // Range profile streams count float values instead of samples
+        const double stream_rate = (stream_format == HACKRF_STREAM_FORMAT_RANGE)
+            ? range_bins / sweep_period : sample_rate;
+        window_samples = (uint32_t)(window_seconds * stream_rate);
+        pre_trigger_samples = (uint32_t)(pre_trigger_seconds * stream_rate);
+        gate_bins = range_bins;
+        window_mode = (trigger == TRIGGER_NONE) ? WINDOW_RECORDING : WINDOW_ARMED;
+
+        for (i = 0; i < capture_count; i++) {
+            capture_t* c = &captures[i];
+            c->window = window_mode;
+            if (pre_trigger_samples > 0) {
+                // Every format has at least a sample per 4 bytes of a segment
+                const int payload = HACKRF_STREAM_SEGMENT_SIZE - sizeof(hackrf_segment_header);
+                c->pre_capacity = pre_trigger_samples / (payload / 4) + 2;
+                c->pre_ring = malloc((size_t)c->pre_capacity * HACKRF_STREAM_SEGMENT_SIZE);
+                if (c->pre_ring == NULL) {
+                    printf("Not enough memory to keep %.3f s before the trigger\n", pre_trigger_seconds);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    // Low byte of the flags is the stream format, range profiles store the
+    // bins per profile in the next 16 bits
+    int flags = stream_format;
+    if (stream_format == HACKRF_STREAM_FORMAT_RANGE) {
+        flags |= range_bins << 8;
+    }
+    for (i = 0; i < capture_count; i++) {
+        if (i > 0 && interleaved) {
+            break;
+        }
+        if (write_header(captures[i].sink, sample_rate, f0, bw, tsweep, delay, flags,
+                interleaved ? HEADER_INTERLEAVED : (uint32_t)i) != 0) {
+            printf("Failed to write the stream header\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-    result = hackrf_start_rx(device, rx_callback, NULL);
+    //Create threads for writing to file
+    for (i = 0; i < capture_count; i++) {
+        pthread_t writer;
+        pthread_attr_t attr;
 
-	if( result != HACKRF_SUCCESS ) {
-		printf("hackrf_start_rx() failed: %s (%d)\n", hackrf_error_name(result), result);
-		usage();
-		return EXIT_FAILURE;
-	}
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if (pthread_create(&writer, &attr, write_thread, &captures[i])) {
+            printf("pthread_create failed\n");
+            return -1;
+        }
+    }
+
+    // Start the boards back to back, capture starts during hackrf_start_rx()
+    for (i = 0; i < capture_count; i++) {
+        const double before = time_now_seconds();
+        result = hackrf_start_rx(captures[i].device, rx_callback, &captures[i]);
+        captures[i].start_time = (before + time_now_seconds()) / 2;
+
+        if( result != HACKRF_SUCCESS ) {
+            printf("hackrf_start_rx() failed: %s (%d)\n", hackrf_error_name(result), result);
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    arm_time = time_now_seconds() + ARM_DELAY;
+    armed = true;
 
 	gettimeofday(&t_start, NULL);
 	gettimeofday(&time_start, NULL);
 
 	printf("Stop with Ctrl-C\n");
-	while( (hackrf_is_streaming(device) == HACKRF_TRUE) &&
-			(do_exit == false) )
+	while( do_exit == false )
 	{
-		uint32_t byte_count_now;
 		struct timeval time_now;
-		float time_difference, rate;
+		float time_difference;
+		bool streaming = true;
 		sleep(1);
 
 		gettimeofday(&time_now, NULL);
+		time_difference = TimevalDiff(&time_now, &time_start);
 
-		byte_count_now = byte_count;
-		byte_count = 0;
+		if (metrics != NULL) {
+			metrics_printf(metrics, "{\"time\":%.3f,\"elapsed\":%.3f,\"interval\":%.3f,\"state\":\"streaming\",\"devices\":[",
+					time_now_seconds(), TimevalDiff(&time_now, &t_start), time_difference);
+		}
 
-		time_difference = TimevalDiff(&time_now, &time_start);
-		rate = (float)byte_count_now / time_difference;
-		printf("%4.1f MiB / %5.3f sec = %4.1f MiB/second\n",
-				(byte_count_now / 1e6f), time_difference, (rate / 1e6f) );
+		for (i = 0; i < capture_count; i++) {
+			capture_t* c = &captures[i];
+			capture_snapshot_t snapshot;
+			uint64_t byte_count_now;
+			float rate;
+			bool have_stats;
+			hackrf_stats stats;
+			hackrf_gap_stats gaps;
+
+			if (hackrf_is_streaming(c->device) != HACKRF_TRUE) {
+				streaming = false;
+			}
+
+			capture_snapshot(c, &snapshot);
+			byte_count_now = snapshot.received - c->received_last;
+
+			rate = (float)byte_count_now / time_difference;
+			if (capture_count > 1) {
+				printf("[%d] ", i);
+			}
+			printf("%4.1f MiB / %5.3f sec = %4.1f MiB/second",
+					(byte_count_now / 1e6f), time_difference, (rate / 1e6f) );
+
+			have_stats = (hackrf_read_stats(c->device, &stats) == HACKRF_SUCCESS);
+			if( have_stats ) {
+				printf(", %u packets dropped", stats.overruns);
+				if( stats.sync_edges != HACKRF_STATS_UNAVAILABLE ) {
+					printf(", %u sync edges", stats.sync_edges);
+				}
+			}
+			if( stream_format != HACKRF_STREAM_FORMAT_RAW ) {
+				hackrf_get_gap_stats(c->device, &gaps);
+				printf(", %u gaps (%llu samples)", gaps.gaps, (unsigned long long)gaps.lost_samples);
+			}
+			if( c->tracking_gain ) {
+				printf(", gain %d (%u steps)", c->gain, c->gain_steps);
+			}
+			if( window_mode == WINDOW_ARMED ) {
+				printf(", %u windows, %s", c->windows,
+						(c->window == WINDOW_RECORDING) ? "recording" : "armed");
+			}
+			if( sink_dropped(c->sink) > 0 && !(i > 0 && interleaved) ) {
+				printf(", %llu MB dropped by the sink", (unsigned long long)(sink_dropped(c->sink) / 1000000));
+			}
+			printf("\n");
+
+			if (metrics != NULL) {
+				if (i > 0) {
+					metrics_printf(metrics, ",");
+				}
+				metrics_capture(metrics, c, &snapshot, time_difference,
+						have_stats ? &stats : NULL,
+						(stream_format != HACKRF_STREAM_FORMAT_RAW) ? &gaps : NULL);
+			}
+			c->received_last = snapshot.received;
+			c->written_last = snapshot.written;
+
+			if (byte_count_now == 0) {
+				exit_code = EXIT_FAILURE;
+				printf("\nCouldn't transfer any bytes for one second.\n");
+				streaming = false;
+			}
+		}
 
 		time_start = time_now;
+		if (metrics != NULL) {
+			metrics_printf(metrics, "]}");
+			metrics_end_line(metrics);
+		}
 
-		if (byte_count_now == 0) {
-			exit_code = EXIT_FAILURE;
-			printf("\nCouldn't transfer any bytes for one second.\n");
+		if (!streaming) {
 			break;
 		}
 	}
 
-	result = hackrf_is_streaming(device);
 	if (do_exit)
 	{
 		printf("\nUser cancel, exiting...\n");
 	} else {
-		printf("\nExiting... hackrf_is_streaming() result: %s (%d)\n", hackrf_error_name(result), result);
+		for (i = 0; i < capture_count; i++) {
+			result = hackrf_is_streaming(captures[i].device);
+			printf("\nExiting... hackrf_is_streaming() result: %s (%d)\n", hackrf_error_name(result), result);
+		}
 	}
 
 	gettimeofday(&t_end, NULL);
 	time_diff = TimevalDiff(&t_end, &t_start);
 	printf("Total time: %5.5f s\n", time_diff);
 
-	if(device != NULL)
+	for (i = 0; i < capture_count; i++)
 	{
+		hackrf_device* device = captures[i].device;
+		hackrf_stats* stats = &final_stats[i];
+
+		if (capture_count > 1) {
+			printf("[%d] ", i);
+		}
+		final_have_stats[i] = (hackrf_read_stats(device, stats) == HACKRF_SUCCESS);
+		if( final_have_stats[i] ) {
+			printf("Interrupts: %u, packets: %u, dropped: %u, transfers: %u, sync edges: ",
+				stats->interrupts, stats->packets, stats->overruns, stats->transfers);
+			if( stats->sync_edges == HACKRF_STATS_UNAVAILABLE ) {
+				printf("n/a\n");
+			} else {
+				printf("%u\n", stats->sync_edges);
+			}
+			printf("Longest interrupt: %u cycles, longest interrupt interval: %u cycles\n",
+				stats->isr_cycles_max, stats->isr_interval_max);
+			if( stats->dma_errors > 0 ) {
+				printf("DMA errors: %u, capture restarted after each\n", stats->dma_errors);
+			}
+		}
+		hackrf_get_gap_stats(device, &final_gaps[i]);
+
         result = hackrf_stop_rx(device);
         if( result != HACKRF_SUCCESS ) {
             printf("hackrf_stop_rx() failed: %s (%d)\n", hackrf_error_name(result), result);
         }else {
             printf("hackrf_stop_rx() done\n");
         }
+	}
 
-		result = hackrf_close(device);
+	for (i = 0; i < capture_count; i++)
+	{
+		result = hackrf_close(captures[i].device);
 		if( result != HACKRF_SUCCESS )
 		{
 			printf("hackrf_close() failed: %s (%d)\n", hackrf_error_name(result), result);
 		}else {
 			printf("hackrf_close() done\n");
 		}
+	}
+
+	hackrf_exit();
+	printf("hackrf_exit() done\n");
 
-		hackrf_exit();
-		printf("hackrf_exit() done\n");
+	// Transfer threads are gone, the edges are final
+	if (capture_count > 1) {
+		align_captures();
 	}
 
-    while ( buf_size() != 0 ) {
-        sleep(1);
-    }
+	for (i = 0; i < capture_count; i++) {
+		capture_t* c = &captures[i];
+		while ( buf_size(c) >= chunk_align ) {
+			sleep(1);
+		}
 
-    while ( !thread_done ) {
-        thread_exit = 1;
-        pthread_mutex_lock(&writer_mutex);
-        pthread_cond_signal(&cond);
-        pthread_mutex_unlock(&writer_mutex);
-    }
+		while ( !c->thread_done ) {
+			c->thread_exit = 1;
+			pthread_mutex_lock(&c->writer_mutex);
+			pthread_cond_signal(&c->cond);
+			pthread_mutex_unlock(&c->writer_mutex);
+		}
+	}
 
-	if(fd != NULL)
+	// Totals of the whole run, once everything reached the sinks
+	if (metrics != NULL) {
+		struct timeval time_now;
+		gettimeofday(&time_now, NULL);
+		metrics_printf(metrics, "{\"time\":%.3f,\"elapsed\":%.3f,\"interval\":%.3f,\"state\":\"stopped\",\"devices\":[",
+				time_now_seconds(), TimevalDiff(&time_now, &t_start), TimevalDiff(&time_now, &time_start));
+		for (i = 0; i < capture_count; i++) {
+			capture_snapshot_t snapshot;
+			capture_snapshot(&captures[i], &snapshot);
+			if (i > 0) {
+				metrics_printf(metrics, ",");
+			}
+			metrics_capture(metrics, &captures[i], &snapshot, TimevalDiff(&time_now, &time_start),
+					final_have_stats[i] ? &final_stats[i] : NULL,
+					(stream_format != HACKRF_STREAM_FORMAT_RAW) ? &final_gaps[i] : NULL);
+		}
+		metrics_printf(metrics, "]}");
+		metrics_end_line(metrics);
+		metrics_close(metrics);
+	}
+
+	for (i = 0; i < capture_count; i++)
 	{
-		fclose(fd);
-		fd = NULL;
-		printf("fclose(fd) done\n");
+		capture_t* c = &captures[i];
+		if(c->sink != NULL && !(i > 0 && interleaved))
+		{
+			if (capture_count > 1) {
+				patch_header(c->sink);
+			}
+			if (sink_dropped(c->sink) > 0) {
+				printf("Sink dropped %llu of %llu bytes\n",
+						(unsigned long long)sink_dropped(c->sink),
+						(unsigned long long)(sink_dropped(c->sink) + sink_written(c->sink)));
+			}
+			if (sink_parts(c->sink) > 1) {
+				printf("Wrote %u parts\n", sink_parts(c->sink));
+			}
+			sink_close(c->sink);
+			printf("sink_close() done\n");
+		}
+		c->sink = NULL;
 	}
 	printf("exit\n");
 	return exit_code;
@@ -0,0 +1,263 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define METRICS_LINE_MAX (16384)
+#define METRICS_CLIENTS_MAX (8)
+
+struct metrics {
+	FILE* file;
+	/* Unix socket */
+	int listener;
+	char* socket_path;
+	int clients[METRICS_CLIENTS_MAX];
+	/* Line being built */
+	char line[METRICS_LINE_MAX];
+	size_t length;
+	int overflow;
+};
+
+uint64_t metrics_now_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / (frequency.QuadPart / 1000000.0));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void metrics_histogram_add(metrics_histogram_t* histogram, uint64_t us)
+{
+	int bucket = 0;
+	uint64_t limit = 1;
+	while (us >= limit && bucket < METRICS_HISTOGRAM_BUCKETS - 1) {
+		limit <<= 1;
+		bucket++;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_us += us;
+	if (us > histogram->max_us) {
+		histogram->max_us = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+	}
+}
+
+#ifndef _WIN32
+static int socket_open(metrics_t* metrics, const char* path)
+{
+	struct sockaddr_un address;
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	metrics->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics->listener < 0) {
+		return -1;
+	}
+	// A socket left by an earlier run
+	unlink(path);
+	if (bind(metrics->listener, (struct sockaddr*)&address, sizeof(address)) != 0
+			|| listen(metrics->listener, METRICS_CLIENTS_MAX) != 0) {
+		return -1;
+	}
+	metrics->socket_path = strdup(path);
+	fcntl(metrics->listener, F_SETFL, fcntl(metrics->listener, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+static void socket_accept(metrics_t* metrics)
+{
+	int fd;
+	while ((fd = accept(metrics->listener, NULL, NULL)) >= 0) {
+		int i;
+		for (i = 0; i < METRICS_CLIENTS_MAX; i++) {
+			if (metrics->clients[i] < 0) {
+				break;
+			}
+		}
+		if (i == METRICS_CLIENTS_MAX) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		metrics->clients[i] = fd;
+	}
+}
+
+static void socket_send(metrics_t* metrics)
+{
+	int i;
+	socket_accept(metrics);
+	for (i = 0; i < METRICS_CLIENTS_MAX; i++) {
+		const int fd = metrics->clients[i];
+		if (fd < 0) {
+			continue;
+		}
+		// A client with a full socket buffer is behind, or gone
+		if (send(fd, metrics->line, metrics->length, MSG_NOSIGNAL) != (ssize_t)metrics->length) {
+			close(fd);
+			metrics->clients[i] = -1;
+		}
+	}
+}
+#endif
+
+metrics_t* metrics_open(const char* spec)
+{
+	int i;
+	int result = -1;
+	metrics_t* metrics = (metrics_t*)calloc(1, sizeof(metrics_t));
+	if (metrics == NULL) {
+		return NULL;
+	}
+	metrics->listener = -1;
+	for (i = 0; i < METRICS_CLIENTS_MAX; i++) {
+		metrics->clients[i] = -1;
+	}
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+#ifndef _WIN32
+		result = socket_open(metrics, spec + 5);
+#endif
+	} else {
+		metrics->file = fopen(spec, "w");
+		result = (metrics->file == NULL) ? -1 : 0;
+	}
+
+	if (result != 0) {
+		metrics_close(metrics);
+		return NULL;
+	}
+	return metrics;
+}
+
+void metrics_printf(metrics_t* metrics, const char* format, ...)
+{
+	va_list args;
+	int length;
+
+	if (metrics->overflow) {
+		return;
+	}
+	va_start(args, format);
+	length = vsnprintf(&metrics->line[metrics->length],
+			sizeof(metrics->line) - metrics->length, format, args);
+	va_end(args);
+	// Room is kept for the newline
+	if (length < 0 || metrics->length + length >= sizeof(metrics->line) - 1) {
+		metrics->overflow = 1;
+		return;
+	}
+	metrics->length += length;
+}
+
+void metrics_histogram_print(metrics_t* metrics, const char* name, const metrics_histogram_t* histogram)
+{
+	int i;
+	int last = 0;
+
+	// Trailing empty buckets are left out
+	for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+		if (histogram->buckets[i] != 0) {
+			last = i;
+		}
+	}
+	metrics_printf(metrics, "\"%s\":{\"count\":%llu,\"total_us\":%llu,\"max_us\":%u,\"log2_us\":[",
+			name, (unsigned long long)histogram->count,
+			(unsigned long long)histogram->total_us, histogram->max_us);
+	for (i = 0; i <= last; i++) {
+		metrics_printf(metrics, (i == 0) ? "%u" : ",%u", histogram->buckets[i]);
+	}
+	metrics_printf(metrics, "]}");
+}
+
+void metrics_end_line(metrics_t* metrics)
+{
+	if (metrics->overflow) {
+		fprintf(stderr, "Metrics line too long, skipped\n");
+	} else {
+		metrics->line[metrics->length++] = '\n';
+		if (metrics->file != NULL) {
+			fwrite(metrics->line, 1, metrics->length, metrics->file);
+			fflush(metrics->file);
+		}
+#ifndef _WIN32
+		if (metrics->listener >= 0) {
+			socket_send(metrics);
+		}
+#endif
+	}
+	metrics->length = 0;
+	metrics->overflow = 0;
+}
+
+void metrics_close(metrics_t* metrics)
+{
+	if (metrics->file != NULL) {
+		fclose(metrics->file);
+	}
+#ifndef _WIN32
+	int i;
+	for (i = 0; i < METRICS_CLIENTS_MAX; i++) {
+		if (metrics->clients[i] >= 0) {
+			close(metrics->clients[i]);
+		}
+	}
+	if (metrics->listener >= 0) {
+		close(metrics->listener);
+	}
+	if (metrics->socket_path != NULL) {
+		unlink(metrics->socket_path);
+		free(metrics->socket_path);
+	}
+#endif
+	free(metrics);
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Machine readable capture metrics of hackrf_transfer, one JSON object per
+ * line, written to
+ *
+ *   path                   regular file or named pipe
+ *   unix:path              Unix stream socket, every connected client gets
+ *                          the lines from when it connects
+ *
+ * Clients that don't keep up are disconnected rather than waited for.
+ */
+
+/* Durations in log2 microsecond buckets: bucket 0 counts durations below
+ * 1 us, bucket n those from 2^(n-1) up to 2^n us, the last one everything
+ * longer. */
+#define METRICS_HISTOGRAM_BUCKETS (24)
+
+typedef struct {
+	uint64_t count;
+	uint64_t total_us;
+	uint32_t max_us;
+	uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} metrics_histogram_t;
+
+uint64_t metrics_now_us(void);
+void metrics_histogram_add(metrics_histogram_t* histogram, uint64_t us);
+
+typedef struct metrics metrics_t;
+
+metrics_t* metrics_open(const char* spec);
+/* Lines are built with printf calls and sent by metrics_end_line() */
+void metrics_printf(metrics_t* metrics, const char* format, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+void metrics_histogram_print(metrics_t* metrics, const char* name, const metrics_histogram_t* histogram);
+void metrics_end_line(metrics_t* metrics);
+void metrics_close(metrics_t* metrics);
+
+#endif//__METRICS_H__
@@ -0,0 +1,882 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* fallocate() */
+#define _GNU_SOURCE
+#endif
+
+#include "sink.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef bool
+typedef int bool;
+#define true 1
+#define false 0
+#endif
+
+typedef enum {
+	SINK_FILE,
+	SINK_STDOUT,
+	SINK_PIPE,
+	SINK_SHM,
+	SINK_UDP,
+	SINK_TCP,
+} sink_type;
+
+struct sink {
+	sink_type type;
+	sink_policy policy;
+	int fd;
+	int fd_flags;	/* Restored on close, -1 if the sink didn't change them */
+	/* Rest of a chunk a dropping consumer took only part of. It's finished
+	 * before anything else is written, so chunks stay whole. */
+	uint8_t* tail;
+	size_t tail_capacity;
+	size_t tail_start, tail_end;
+	uint8_t header[SINK_HEADER_MAX];
+	size_t header_size;
+	uint64_t written;
+	uint64_t dropped;
+	/* Shared memory */
+	char* shm_name;
+	sink_shm_ring_t* ring;
+	size_t ring_map_size;
+	/* Datagrams */
+	uint32_t datagrams;
+	sink_udp_datagram_t datagram;
+	/* File rotation, the opener thread keeps the next part ready and
+	 * truncates and closes finished ones */
+	sink_options_t options;
+	char* path;
+	uint32_t part;	/* Part being written */
+	uint64_t part_bytes;
+	double part_start;
+	uint64_t prealloc;
+	pthread_t opener;
+	bool opener_started;
+	pthread_mutex_t opener_mutex;
+	pthread_cond_t opener_cond;
+	int spare_fd;	/* Part part + 1, SPARE_PENDING while it's being opened */
+	int retire_fd;
+	bool opener_exit;
+};
+
+#define SPARE_PENDING (-1)
+#define SPARE_FAILED (-2)
+
+// How long closing a dropping sink waits for the consumer to take a tail
+#define SINK_DRAIN_MS (1000)
+
+static const char* prefix_arg(const char* spec, const char* prefix)
+{
+	const size_t n = strlen(prefix);
+	return (strncmp(spec, prefix, n) == 0) ? spec + n : NULL;
+}
+
+/* Waits for a non-blocking consumer too, only used where nothing may be
+ * dropped (headers) */
+static int write_all(int fd, const uint8_t* data, size_t length)
+{
+	while (length > 0) {
+		const ssize_t n = write(fd, data, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+#ifndef _WIN32
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd p = { fd, POLLOUT, 0 };
+				poll(&p, 1, -1);
+				continue;
+			}
+#endif
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+/* Writes what a non-blocking consumer takes right now. Returns the bytes
+ * written, or -1 on error. */
+static ssize_t write_some(int fd, const uint8_t* data, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		const ssize_t n = write(fd, data + done, length - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/* Returns 1 once no tail is left, 0 while the consumer still holds it up,
+ * or -1 on error */
+static int tail_flush(sink_t* sink)
+{
+	if (sink->tail_start == sink->tail_end) {
+		return 1;
+	}
+	const ssize_t n = write_some(sink->fd, &sink->tail[sink->tail_start], sink->tail_end - sink->tail_start);
+	if (n < 0) {
+		return -1;
+	}
+	sink->tail_start += n;
+	sink->written += n;
+	sink->part_bytes += n;
+	return sink->tail_start == sink->tail_end;
+}
+
+/* Only whole chunks are dropped, a framed consumer would lose its place
+ * in a cut one */
+static int drop_write(sink_t* sink, const uint8_t* data, size_t length)
+{
+	const int flushed = tail_flush(sink);
+	if (flushed <= 0) {
+		if (flushed == 0) {
+			sink->dropped += length;
+		}
+		return flushed;
+	}
+	const ssize_t n = write_some(sink->fd, data, length);
+	if (n < 0) {
+		return -1;
+	}
+	sink->written += n;
+	sink->part_bytes += n;
+	if (n == 0) {
+		sink->dropped += length;
+	} else if ((size_t)n < length) {
+		if (length - n > sink->tail_capacity) {
+			uint8_t* tail = realloc(sink->tail, length - n);
+			if (tail == NULL) {
+				return -1;
+			}
+			sink->tail = tail;
+			sink->tail_capacity = length - n;
+		}
+		memcpy(sink->tail, data + n, length - n);
+		sink->tail_start = 0;
+		sink->tail_end = length - n;
+	}
+	return 0;
+}
+
+/* Give the consumer a while to take the tail, what's left then ends the
+ * stream early rather than holding up the exit */
+static void tail_drain(sink_t* sink)
+{
+	int waited = 0;
+	while (tail_flush(sink) == 0 && waited < SINK_DRAIN_MS) {
+		struct pollfd p = { sink->fd, POLLOUT, 0 };
+		poll(&p, 1, 10);
+		waited += 10;
+	}
+	if (sink->tail_start < sink->tail_end) {
+		sink->dropped += sink->tail_end - sink->tail_start;
+		sink->tail_start = sink->tail_end;
+	}
+}
+#endif
+
+#ifndef _WIN32
+static int shm_open_ring(sink_t* sink, const char* arg)
+{
+	char name[256];
+	size_t size = (size_t)SINK_SHM_SIZE_DEFAULT << 20;
+	const char* colon = strchr(arg, ':');
+	size_t length = colon ? (size_t)(colon - arg) : strlen(arg);
+
+	if (length == 0 || length > sizeof(name) - 2) {
+		return -1;
+	}
+	if (colon) {
+		const long mib = strtol(colon + 1, NULL, 10);
+		if (mib <= 0) {
+			return -1;
+		}
+		size = (size_t)mib << 20;
+	}
+	name[0] = '/';
+	memcpy(&name[1], arg, length);
+	name[length + 1] = 0;
+
+	sink->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (sink->fd < 0) {
+		return -1;
+	}
+	sink->shm_name = strdup(name);
+	sink->ring_map_size = sizeof(sink_shm_ring_t) + size;
+	if (ftruncate(sink->fd, sink->ring_map_size) != 0) {
+		return -1;
+	}
+	sink->ring = mmap(NULL, sink->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, 0);
+	if (sink->ring == MAP_FAILED) {
+		sink->ring = NULL;
+		return -1;
+	}
+	memcpy(sink->ring->magic, SINK_SHM_MAGIC, 4);
+	sink->ring->version = SINK_SHM_VERSION;
+	sink->ring->header_size = 0;
+	sink->ring->data_offset = sizeof(sink_shm_ring_t);
+	sink->ring->size = size;
+	sink->ring->write_limit = 0;
+	sink->ring->write_count = 0;
+	return 0;
+}
+
+static void shm_write(sink_t* sink, const uint8_t* data, size_t length)
+{
+	sink_shm_ring_t* ring = sink->ring;
+	uint8_t* base = (uint8_t*)ring + ring->data_offset;
+	uint64_t count = ring->write_count;
+
+	/* Only the end of a chunk larger than the ring survives */
+	if (length > ring->size) {
+		data += length - ring->size;
+		count += length - ring->size;
+		length = ring->size;
+	}
+
+	ring->write_limit = count + length;
+	__sync_synchronize();
+	while (length > 0) {
+		const size_t pos = count % ring->size;
+		const size_t n = (length < ring->size - pos) ? length : ring->size - pos;
+		memcpy(&base[pos], data, n);
+		data += n;
+		count += n;
+		length -= n;
+	}
+	__sync_synchronize();
+	ring->write_count = count;
+}
+
+static int net_open(sink_t* sink, const char* arg, int socktype)
+{
+	char host[256];
+	struct addrinfo hints;
+	struct addrinfo* addrs;
+	struct addrinfo* a;
+	const char* port = strrchr(arg, ':');
+
+	if (port == NULL || (size_t)(port - arg) >= sizeof(host)) {
+		return -1;
+	}
+	memcpy(host, arg, port - arg);
+	host[port - arg] = 0;
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+		return -1;
+	}
+	for (a = addrs; a != NULL; a = a->ai_next) {
+		sink->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (sink->fd < 0) {
+			continue;
+		}
+		/* A connected datagram socket can use write() */
+		if (connect(sink->fd, a->ai_addr, a->ai_addrlen) == 0) {
+			break;
+		}
+		close(sink->fd);
+		sink->fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if (sink->fd < 0) {
+		return -1;
+	}
+
+	if (socktype == SOCK_DGRAM && sink->policy == SINK_DROP) {
+		fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) | O_NONBLOCK);
+	}
+	return 0;
+}
+
+/* Returns 1 if the datagram was dropped */
+static int udp_send(sink_t* sink, uint64_t offset, const uint8_t* data, size_t length)
+{
+	sink->datagram.offset = offset;
+	memcpy(sink->datagram.payload, data, length);
+	const ssize_t n = send(sink->fd, &sink->datagram, sizeof(sink->datagram.offset) + length, 0);
+	if (n < 0) {
+		/* Nobody listening yet on the other end is not an error */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED) {
+			return 1;
+		}
+		return -1;
+	}
+	sink->datagrams++;
+	return 0;
+}
+
+static int udp_write(sink_t* sink, const uint8_t* data, size_t length)
+{
+	while (length > 0) {
+		const size_t n = (length < SINK_UDP_PAYLOAD) ? length : SINK_UDP_PAYLOAD;
+		if ((sink->datagrams % SINK_UDP_HEADER_INTERVAL) == 0 && sink->header_size > 0) {
+			if (udp_send(sink, SINK_UDP_HEADER, sink->header, sink->header_size) < 0) {
+				return -1;
+			}
+		}
+		const int result = udp_send(sink, sink->written + sink->dropped, data, n);
+		if (result < 0) {
+			return -1;
+		} else if (result > 0) {
+			sink->dropped += n;
+		} else {
+			sink->written += n;
+		}
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+#endif
+
+#ifndef _WIN32
+static double monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void part_name(const sink_t* sink, uint32_t part, char* name, size_t size)
+{
+	snprintf(name, size, "%s.%04u", sink->path, part);
+}
+
+/* Blocks for the whole part are allocated up front, so writes never wait
+ * on the filesystem allocating them. The size stays at what was written. */
+static int part_open(const sink_t* sink, uint32_t part, uint64_t prealloc)
+{
+	char name[FILENAME_MAX];
+	part_name(sink, part, name, sizeof(name));
+	const int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (fd >= 0 && prealloc > 0) {
+		// Not every filesystem can, recording goes on without
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+	}
+#else
+	(void)prealloc;
+#endif
+	return fd;
+}
+
+static void part_close(int fd)
+{
+	// Give back the preallocated blocks that weren't used
+	const off_t size = lseek(fd, 0, SEEK_CUR);
+	if (size >= 0 && ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Failed to trim a recording part\n");
+	}
+	close(fd);
+}
+
+static void* opener_thread(void* arg)
+{
+	sink_t* sink = (sink_t*)arg;
+
+	pthread_mutex_lock(&sink->opener_mutex);
+	while (1) {
+		if (sink->retire_fd >= 0) {
+			const int fd = sink->retire_fd;
+			sink->retire_fd = -1;
+			pthread_mutex_unlock(&sink->opener_mutex);
+			part_close(fd);
+			pthread_mutex_lock(&sink->opener_mutex);
+			pthread_cond_broadcast(&sink->opener_cond);
+		} else if (sink->opener_exit) {
+			break;
+		} else if (sink->spare_fd == SPARE_PENDING) {
+			const uint32_t part = sink->part + 1;
+			const uint64_t prealloc = sink->prealloc;
+			pthread_mutex_unlock(&sink->opener_mutex);
+			const int fd = part_open(sink, part, prealloc);
+			pthread_mutex_lock(&sink->opener_mutex);
+			sink->spare_fd = (fd >= 0) ? fd : SPARE_FAILED;
+			pthread_cond_broadcast(&sink->opener_cond);
+		} else {
+			pthread_cond_wait(&sink->opener_cond, &sink->opener_mutex);
+		}
+	}
+	pthread_mutex_unlock(&sink->opener_mutex);
+	return NULL;
+}
+
+static int rotation_open(sink_t* sink, const char* path)
+{
+	sink->path = strdup(path);
+	if (sink->path == NULL) {
+		return -1;
+	}
+	sink->part = 0;
+	sink->prealloc = sink->options.rotate_bytes;
+	sink->fd = part_open(sink, 0, sink->prealloc);
+	if (sink->fd < 0) {
+		return -1;
+	}
+	sink->part_start = monotonic_seconds();
+
+	sink->spare_fd = SPARE_PENDING;
+	sink->retire_fd = -1;
+	sink->opener_exit = false;
+	pthread_mutex_init(&sink->opener_mutex, NULL);
+	pthread_cond_init(&sink->opener_cond, NULL);
+	if (pthread_create(&sink->opener, NULL, opener_thread, sink) != 0) {
+		return -1;
+	}
+	sink->opener_started = true;
+	return 0;
+}
+
+/* Switch to the part the opener has ready, it starts with the same header */
+static int rotate(sink_t* sink)
+{
+	int fd;
+
+	pthread_mutex_lock(&sink->opener_mutex);
+	while (sink->spare_fd == SPARE_PENDING || sink->retire_fd >= 0) {
+		pthread_cond_wait(&sink->opener_cond, &sink->opener_mutex);
+	}
+	fd = sink->spare_fd;
+	if (fd == SPARE_FAILED) {
+		pthread_mutex_unlock(&sink->opener_mutex);
+		return -1;
+	}
+	sink->retire_fd = sink->fd;
+	sink->fd = fd;
+	sink->part++;
+	// Parts limited by time are sized from the one before
+	if (sink->options.rotate_bytes == 0) {
+		sink->prealloc = sink->part_bytes;
+	}
+	sink->spare_fd = SPARE_PENDING;
+	pthread_cond_broadcast(&sink->opener_cond);
+	pthread_mutex_unlock(&sink->opener_mutex);
+
+	sink->part_start = monotonic_seconds();
+	sink->part_bytes = sink->header_size;
+	return write_all(sink->fd, sink->header, sink->header_size);
+}
+
+static bool rotation_due(const sink_t* sink, size_t length)
+{
+	if (sink->path == NULL || sink->part_bytes <= sink->header_size) {
+		return false;
+	}
+	if (sink->options.rotate_bytes > 0 && sink->part_bytes + length > sink->options.rotate_bytes) {
+		return true;
+	}
+	return (sink->options.rotate_seconds > 0)
+		&& (monotonic_seconds() - sink->part_start >= sink->options.rotate_seconds);
+}
+
+static void rotation_close(sink_t* sink)
+{
+	char name[FILENAME_MAX];
+
+	if (sink->opener_started) {
+		pthread_mutex_lock(&sink->opener_mutex);
+		sink->opener_exit = true;
+		pthread_cond_broadcast(&sink->opener_cond);
+		pthread_mutex_unlock(&sink->opener_mutex);
+		pthread_join(sink->opener, NULL);
+		pthread_mutex_destroy(&sink->opener_mutex);
+		pthread_cond_destroy(&sink->opener_cond);
+
+		// The next part was opened ahead and never written
+		if (sink->spare_fd >= 0) {
+			close(sink->spare_fd);
+			part_name(sink, sink->part + 1, name, sizeof(name));
+			unlink(name);
+		}
+	}
+	if (sink->fd >= 0) {
+		part_close(sink->fd);
+		sink->fd = -1;
+	}
+	free(sink->path);
+	sink->path = NULL;
+}
+#endif
+
+sink_t* sink_open(const char* spec, const sink_options_t* options)
+{
+	char arg[FILENAME_MAX];
+	const char* s;
+	char* comma;
+	int result = -1;
+	sink_t* sink = calloc(1, sizeof(sink_t));
+	if (sink == NULL) {
+		return NULL;
+	}
+	sink->fd = -1;
+	sink->fd_flags = -1;
+	if (options) {
+		sink->options = *options;
+	}
+
+	sink->type = SINK_FILE;
+	sink->policy = SINK_BLOCK;
+	if ((s = prefix_arg(spec, "pipe:"))) {
+		sink->type = SINK_PIPE;
+	} else if ((s = prefix_arg(spec, "shm:"))) {
+		sink->type = SINK_SHM;
+		sink->policy = SINK_OVERWRITE;
+	} else if ((s = prefix_arg(spec, "udp:"))) {
+		sink->type = SINK_UDP;
+		sink->policy = SINK_DROP;
+	} else if ((s = prefix_arg(spec, "tcp:"))) {
+		sink->type = SINK_TCP;
+	} else if ((s = prefix_arg(spec, "file:"))) {
+		sink->type = SINK_FILE;
+	} else if (strcmp(spec, "-") == 0 || strncmp(spec, "-,", 2) == 0) {
+		sink->type = SINK_STDOUT;
+		s = spec;
+	} else {
+		s = spec;
+	}
+	snprintf(arg, sizeof(arg), "%s", s);
+
+	comma = strrchr(arg, ',');
+	if (comma && sink->type != SINK_SHM) {
+		if (strcmp(comma, ",block") == 0) {
+			sink->policy = SINK_BLOCK;
+			*comma = 0;
+		} else if (strcmp(comma, ",drop") == 0) {
+			sink->policy = SINK_DROP;
+			*comma = 0;
+		}
+	}
+
+	switch (sink->type) {
+	case SINK_FILE:
+		if (sink->options.rotate_bytes > 0 || sink->options.rotate_seconds > 0) {
+#ifndef _WIN32
+			result = rotation_open(sink, arg);
+#endif
+			break;
+		}
+		sink->fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+		result = (sink->fd < 0) ? -1 : 0;
+		break;
+
+	case SINK_STDOUT:
+		/* Keep the real stdout for data, everything printed goes to stderr */
+		fflush(stdout);
+		sink->fd = dup(STDOUT_FILENO);
+		if (sink->fd >= 0) {
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			result = 0;
+		}
+		break;
+
+#ifndef _WIN32
+	case SINK_PIPE:
+		if (mkfifo(arg, 0644) != 0 && errno != EEXIST) {
+			break;
+		}
+		fprintf(stderr, "Waiting for a reader on %s\n", arg);
+		sink->fd = open(arg, O_WRONLY);
+		result = (sink->fd < 0) ? -1 : 0;
+		break;
+
+	case SINK_SHM:
+		result = shm_open_ring(sink, arg);
+		break;
+
+	case SINK_UDP:
+		result = net_open(sink, arg, SOCK_DGRAM);
+		break;
+
+	case SINK_TCP:
+		result = net_open(sink, arg, SOCK_STREAM);
+		break;
+#else
+	default:
+		break;
+#endif
+	}
+
+#ifndef _WIN32
+	/* A stalled consumer must not hold up the writer, what it doesn't take
+	 * is dropped. stdout may share its flags with the terminal, so they're
+	 * put back on close. */
+	if (result == 0 && sink->policy == SINK_DROP && sink->fd >= 0 && sink->type != SINK_UDP) {
+		const int flags = fcntl(sink->fd, F_GETFL);
+		if (flags < 0 || fcntl(sink->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			result = -1;
+		} else {
+			sink->fd_flags = flags;
+		}
+	}
+#endif
+	if (result != 0) {
+		sink_close(sink);
+		return NULL;
+	}
+#ifndef _WIN32
+	/* A consumer going away shows up as a failed write */
+	if (sink->type == SINK_STDOUT || sink->type == SINK_PIPE || sink->type == SINK_TCP) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+#endif
+	return sink;
+}
+
+int sink_device_spec(char* out, size_t size, const char* spec, int index)
+{
+	const char* s;
+	size_t end;
+
+	if (prefix_arg(spec, "udp:") || prefix_arg(spec, "tcp:")
+		|| strcmp(spec, "-") == 0 || strncmp(spec, "-,", 2) == 0) {
+		return -1;
+	}
+
+	/* The suffix goes on the name, ahead of a ring size or policy */
+	end = strlen(spec);
+	if ((s = prefix_arg(spec, "shm:")) && strchr(s, ':')) {
+		end = strchr(s, ':') - spec;
+	} else if ((s = strrchr(spec, ',')) && (strcmp(s, ",block") == 0 || strcmp(s, ",drop") == 0)) {
+		end = s - spec;
+	}
+	if (snprintf(out, size, "%.*s.%d%s", (int)end, spec, index, &spec[end]) >= (int)size) {
+		return -1;
+	}
+	return 0;
+}
+
+const char* sink_policy_name(const sink_t* sink)
+{
+	switch (sink->policy) {
+	case SINK_BLOCK:
+		return "block";
+	case SINK_DROP:
+		return "drop";
+	case SINK_OVERWRITE:
+		return "overwrite";
+	}
+	return "unknown";
+}
+
+int sink_write_header(sink_t* sink, const void* header, size_t length)
+{
+	if (length > SINK_HEADER_MAX) {
+		return -1;
+	}
+	memcpy(sink->header, header, length);
+	sink->header_size = length;
+
+	switch (sink->type) {
+#ifndef _WIN32
+	case SINK_SHM:
+		memcpy(sink->ring->header, header, length);
+		__sync_synchronize();
+		sink->ring->header_size = length;
+		return 0;
+
+	case SINK_UDP:
+		// Goes out in front of the first datagram
+		return 0;
+#endif
+
+	default:
+		sink->part_bytes = length;
+		return write_all(sink->fd, header, length);
+	}
+}
+
+int sink_write(sink_t* sink, const void* data, size_t length)
+{
+	switch (sink->type) {
+#ifndef _WIN32
+	case SINK_SHM:
+		shm_write(sink, data, length);
+		sink->written += length;
+		return 0;
+
+	case SINK_UDP:
+		return udp_write(sink, data, length);
+#endif
+
+	default:
+#ifndef _WIN32
+		// Parts only ever end on a whole chunk
+		if (rotation_due(sink, length) && rotate(sink) != 0) {
+			return -1;
+		}
+#endif
+#ifndef _WIN32
+		if (sink->policy == SINK_DROP) {
+			return drop_write(sink, data, length);
+		}
+#endif
+		if (write_all(sink->fd, data, length) != 0) {
+			return -1;
+		}
+		sink->written += length;
+		sink->part_bytes += length;
+		return 0;
+	}
+}
+
+int sink_patch_header(sink_t* sink, size_t offset, const void* data, size_t length)
+{
+	if (offset + length > sink->header_size) {
+		return -1;
+	}
+	memcpy(&sink->header[offset], data, length);
+
+	switch (sink->type) {
+	case SINK_FILE:
+#ifndef _WIN32
+		// Every part starts with the header
+		if (sink->path != NULL) {
+			char name[FILENAME_MAX];
+			uint32_t part;
+			for (part = 0; part < sink->part; part++) {
+				part_name(sink, part, name, sizeof(name));
+				const int fd = open(name, O_WRONLY);
+				if (fd < 0 || pwrite(fd, data, length, offset) != (ssize_t)length) {
+					if (fd >= 0) {
+						close(fd);
+					}
+					return -1;
+				}
+				close(fd);
+			}
+		}
+#endif
+		if (lseek(sink->fd, offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		if (write_all(sink->fd, data, length) != 0) {
+			return -1;
+		}
+		return (lseek(sink->fd, 0, SEEK_END) < 0) ? -1 : 0;
+
+#ifndef _WIN32
+	case SINK_SHM:
+		memcpy(&sink->ring->header[offset], data, length);
+		return 0;
+
+	case SINK_UDP:
+		return (udp_send(sink, SINK_UDP_HEADER, sink->header, sink->header_size) < 0) ? -1 : 0;
+#endif
+
+	default:
+		return -1;
+	}
+}
+
+void sink_close(sink_t* sink)
+{
+	if (sink == NULL) {
+		return;
+	}
+#ifndef _WIN32
+	if (sink->ring != NULL) {
+		munmap(sink->ring, sink->ring_map_size);
+	}
+	if (sink->shm_name != NULL) {
+		/* Viewers that have it mapped keep their view */
+		shm_unlink(sink->shm_name);
+		free(sink->shm_name);
+	}
+	if (sink->path != NULL) {
+		rotation_close(sink);
+	}
+	if (sink->fd >= 0 && sink->tail != NULL) {
+		tail_drain(sink);
+	}
+	free(sink->tail);
+	if (sink->fd >= 0 && sink->fd_flags >= 0) {
+		fcntl(sink->fd, F_SETFL, sink->fd_flags);
+	}
+#endif
+	if (sink->fd >= 0) {
+		close(sink->fd);
+	}
+	free(sink);
+}
+
+uint64_t sink_written(const sink_t* sink)
+{
+	return sink->written;
+}
+
+uint64_t sink_dropped(const sink_t* sink)
+{
+	return sink->dropped;
+}
+
+uint32_t sink_parts(const sink_t* sink)
+{
+#ifndef _WIN32
+	if (sink->path != NULL) {
+		return sink->part + 1;
+	}
+#endif
+	return 1;
+}
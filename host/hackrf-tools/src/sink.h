@@ -0,0 +1,113 @@
+/*
+ * This file is part of HackRF.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Destinations for the capture stream of hackrf_transfer. A sink gets the
+ * file header once, then the stream in chunks from the writer thread.
+ *
+ *   path, file:path        regular file
+ *   -                      stdout, messages move to stderr
+ *   pipe:path              named pipe, created if missing
+ *   shm:name[:MiB]         POSIX shared memory ring, see sink_shm_ring_t
+ *   udp:host:port          datagrams, see sink_udp_datagram_t
+ *   tcp:host:port          connection to a listening processing host
+ *
+ * A ",block" or ",drop" suffix overrides the backpressure policy of the
+ * sink. Shared memory always overwrites the oldest data. Dropping sinks
+ * never wait for the consumer and drop whole sink_write() chunks, counted
+ * in sink_dropped(). A chunk the consumer took part of is finished first.
+ */
+
+/* A file sink with a rotation limit writes parts path.0000, path.0001, ...
+ * each starting with the same header, so any part can be processed on its
+ * own. Parts are preallocated and the next one is opened ahead of time by
+ * a helper thread, which also trims and closes the finished ones.
+ */
+typedef struct {
+	uint64_t rotate_bytes;	/* Part size limit, 0 for none */
+	double rotate_seconds;	/* Part duration limit, 0 for none */
+} sink_options_t;
+
+typedef enum {
+	SINK_BLOCK = 0,	/* Wait for the consumer, the capture ring absorbs stalls */
+	SINK_DROP = 1,	/* Skip whole chunks while the consumer isn't ready */
+	SINK_OVERWRITE = 2,	/* Never wait, readers that fall behind lose data */
+} sink_policy;
+
+/* Room for the largest FMCW file header */
+#define SINK_HEADER_MAX (256)
+
+/* Shared memory layout. write_limit is raised before a chunk is copied
+ * and write_count after it, so a reader that copied stream bytes from
+ * offset start has valid data if start >= write_limit - size afterwards.
+ */
+#define SINK_SHM_MAGIC "FMCR"
+#define SINK_SHM_VERSION (1)
+#define SINK_SHM_SIZE_DEFAULT (64)
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t header_size;	/* Bytes of the file header in header[] */
+	uint32_t data_offset;	/* Start of the ring from the start of the object */
+	uint64_t size;	/* Ring bytes, stream offset n is at data_offset + n % size */
+	volatile uint64_t write_limit;	/* End of the chunk being copied */
+	volatile uint64_t write_count;	/* Stream bytes written */
+	uint8_t header[SINK_HEADER_MAX];
+} sink_shm_ring_t;
+
+/* Every datagram starts with the stream offset of its payload. The file
+ * header goes out with offset SINK_UDP_HEADER, again every
+ * SINK_UDP_HEADER_INTERVAL datagrams for receivers that join late.
+ */
+#define SINK_UDP_PAYLOAD (1472 - 8)
+#define SINK_UDP_HEADER (0xFFFFFFFFFFFFFFFFull)
+#define SINK_UDP_HEADER_INTERVAL (4096)
+
+typedef struct {
+	uint64_t offset;
+	uint8_t payload[SINK_UDP_PAYLOAD];
+} sink_udp_datagram_t;
+
+typedef struct sink sink_t;
+
+/* options may be NULL */
+sink_t* sink_open(const char* spec, const sink_options_t* options);
+/* Spec of a per-device sink with a ".index" suffix on the name, -1 for
+ * sinks that can't be told apart by name */
+int sink_device_spec(char* out, size_t size, const char* spec, int index);
+const char* sink_policy_name(const sink_t* sink);
+
+/* Returns 0 on success, or -1 when the sink failed and can't continue */
+int sink_write_header(sink_t* sink, const void* header, size_t length);
+int sink_write(sink_t* sink, const void* data, size_t length);
+/* Rewrite part of the header where the sink allows it, 0 if it did */
+int sink_patch_header(sink_t* sink, size_t offset, const void* data, size_t length);
+void sink_close(sink_t* sink);
+
+uint64_t sink_written(const sink_t* sink);
+uint64_t sink_dropped(const sink_t* sink);
+uint32_t sink_parts(const sink_t* sink);
+
+#endif//__SINK_H__
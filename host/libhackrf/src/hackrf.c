@@ -21,14 +21,24 @@ HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABI
 ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
+#endif
+
 #include "hackrf.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <libusb.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <math.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #ifndef bool
 typedef int bool;
@@ -41,12 +51,19 @@ typedef int bool;
 
 #ifdef HACKRF_BIG_ENDIAN
 #define TO_LE(x) __builtin_bswap32(x)
+#define TO_LE16(x) __builtin_bswap16(x)
 #define TO_LE64(x) __builtin_bswap64(x)
 #else
 #define TO_LE(x) x
+#define TO_LE16(x) x
 #define TO_LE64(x) x
 #endif
 
+/* Samples in a zero-filled segment, 90 packets fit every framed sample
+ * format, range profiles are float32 values */
+#define GAP_FILL_SAMPLES (90*31)
+#define GAP_FILL_RANGE_VALUES ((HACKRF_STREAM_SEGMENT_SIZE - sizeof(hackrf_segment_header)) / 4)
+
 #define GPIO_ADF (1 << 0)
 #define GPIO_ADC (1 << 1)
 #define GPIO_PA  (1 << 2)
@@ -63,12 +80,22 @@ typedef enum {
 	HACKRF_VENDOR_REQUEST_CLEAR_GPIO = 5,
 	HACKRF_VENDOR_REQUEST_SET_MCP = 6,
 	HACKRF_VENDOR_REQUEST_SET_CLOCK = 7,
+	HACKRF_VENDOR_REQUEST_SET_CAPTURE_MODE = 8,
+	HACKRF_VENDOR_REQUEST_SET_STREAM_FORMAT = 9,
 	HACKRF_VENDOR_REQUEST_SPIFLASH_ERASE = 10,
 	HACKRF_VENDOR_REQUEST_SPIFLASH_WRITE = 11,
 	HACKRF_VENDOR_REQUEST_SPIFLASH_READ = 12,
+	HACKRF_VENDOR_REQUEST_READ_OVERRUNS = 13,
 	HACKRF_VENDOR_REQUEST_BOARD_ID_READ = 14,
 	HACKRF_VENDOR_REQUEST_VERSION_STRING_READ = 15,
+	HACKRF_VENDOR_REQUEST_READ_STATS = 16,
+	HACKRF_VENDOR_REQUEST_SET_DECIMATION = 17,
 	HACKRF_VENDOR_REQUEST_BOARD_PARTID_SERIALNO_READ = 18,
+	HACKRF_VENDOR_REQUEST_SET_RANGE_BINS = 19,
+	HACKRF_VENDOR_REQUEST_ADF4158_WRITE_IMAGE = 20,
+	HACKRF_VENDOR_REQUEST_LOAD_SWEEP_PROFILE = 21,
+	HACKRF_VENDOR_REQUEST_SELECT_SWEEP_PROFILE = 22,
+	HACKRF_VENDOR_REQUEST_SET_GAIN_CONTROL = 23,
 } hackrf_vendor_request;
 
 typedef enum {
@@ -88,11 +115,26 @@ struct hackrf_device {
 	hackrf_sample_block_cb_fn callback;
 	volatile bool transfer_thread_started; /* volatile shared between threads (read only) */
 	pthread_t transfer_thread;
+	hackrf_transfer_options transfer_options;
+	libusb_context* usb_context; /* g_libusb_context unless private_context is set */
 	uint32_t transfer_count;
 	uint32_t buffer_size;
 	volatile bool streaming; /* volatile shared between threads (read only) */
 	void* rx_ctx;
 	void* tx_ctx;
+	uint16_t stream_format; /* enum hackrf_stream_format */
+	bool gap_fill;
+	/* Framed stream state, only touched by the transfer thread */
+	uint32_t segment_offset;
+	bool segment_synced;
+	uint32_t next_sequence;
+	uint32_t next_sample;
+	uint16_t segment_profile;
+	uint8_t segment_gain;
+	/* Updated by the transfer thread, read by hackrf_get_gap_stats() */
+	pthread_mutex_t gap_stats_mutex;
+	hackrf_gap_stats gap_stats;
+	uint32_t adf4158[HACKRF_ADF4158_REGISTERS];
 };
 
 typedef struct {
@@ -120,74 +162,69 @@ static const max2837_ft_t max2837_ft[] = {
 };
 
 typedef struct {
-    char *name;
     int reg;
     int bit;
     int len;
 } adf_reg;
 
-const static adf_reg adf4158_regs[] = {
-    { "frac_msb", 0, 3, 12 },
-    { "n", 0, 15, 12 },
-    { "muxout", 0, 27, 4 },
-    { "ramp_on", 0, 31, 1 },
-    { "frac_lsb", 1, 15, 13 },
-    { "reserved1", 1, 3, 12 },
-    { "reserved0", 1, 28, 4 },
-    { "r_counter", 2, 15, 5 },
-    { "csr_en", 2, 28, 1 },
-    { "rdiv2", 2, 21, 1 },
-    { "prescaler", 2, 22, 1 },
-    { "reference_doubler", 2, 20, 1 },
-    { "cp_current", 2, 24, 4 },
-    { "clk1_divider", 2, 3, 12 },
-    { "reserved3", 2, 23, 1 },
-    { "reserved2", 2, 29, 3 },
-    { "power_down", 3, 5, 1 },
-    { "psk_enable", 3, 9, 1 },
-    { "fsk_enable", 3, 8, 1 },
-    { "sd_reset", 3, 14, 1 },
-    { "counter_reset", 3, 3, 1 },
-    { "reserved5", 3, 12, 2 },
-    { "reserved4", 3, 16, 16 },
-    { "ramp_mode", 3, 10, 2 },
-    { "n_sel", 3, 15, 1 },
-    { "cp_3state", 3, 4, 1 },
-    { "lpd", 3, 7, 1 },
-    { "pd_polarity", 3, 6, 1 },
-    { "neg_bleed_current", 4, 23, 2 },
-    { "clk_div_mode", 4, 19, 2 },
-    { "clk2_divider", 4, 7, 12 },
-    { "sd_mod_mode", 4, 26, 5 },
-    { "reserved7", 4, 3, 4 },
-    { "reserved6", 4, 25, 1 },
-    { "lf_sel", 4, 31, 1 },
-    { "readback_to_muxout", 4, 21, 2 },
-    { "fsk_ramp_en", 5, 25, 1 },
-    { "tx_ramp_clk", 5, 29, 1 },
-    { "dev_offset", 5, 19, 4 },
-    { "par_ramp", 5, 28, 1 },
-    { "reserved8", 5, 30, 2 },
-    { "dev_sel", 5, 23, 1 },
-    { "interrupt", 5, 26, 2 },
-    { "ramp2_en", 5, 24, 1 },
-    { "deviation", 5, 3, 16 },
-    { "step", 6, 3, 20 },
-    { "reserved9", 6, 24, 8 },
-    { "step_sel", 6, 23, 1 },
-    { "reserved10", 7, 19, 13 },
-    { "ramp_del", 7, 17, 1 },
-    { "ramp_del_fl", 7, 18, 1 },
-    { "del_start_en", 7, 15, 1 },
-    { "delay_start_divider", 7, 3, 12 },
-    { "del_clk_sel", 7, 16, 1 },
-    { "", 0, 0, 0}
+/* Location of each enum hackrf_adf4158_field in the register image */
+static const adf_reg adf4158_regs[HACKRF_ADF4158_FIELD_COUNT] = {
+    [HACKRF_ADF4158_FRAC_MSB] = { 0, 3, 12 },
+    [HACKRF_ADF4158_N] = { 0, 15, 12 },
+    [HACKRF_ADF4158_MUXOUT] = { 0, 27, 4 },
+    [HACKRF_ADF4158_RAMP_ON] = { 0, 31, 1 },
+    [HACKRF_ADF4158_FRAC_LSB] = { 1, 15, 13 },
+    [HACKRF_ADF4158_RESERVED1] = { 1, 3, 12 },
+    [HACKRF_ADF4158_RESERVED0] = { 1, 28, 4 },
+    [HACKRF_ADF4158_R_COUNTER] = { 2, 15, 5 },
+    [HACKRF_ADF4158_CSR_EN] = { 2, 28, 1 },
+    [HACKRF_ADF4158_RDIV2] = { 2, 21, 1 },
+    [HACKRF_ADF4158_PRESCALER] = { 2, 22, 1 },
+    [HACKRF_ADF4158_REFERENCE_DOUBLER] = { 2, 20, 1 },
+    [HACKRF_ADF4158_CP_CURRENT] = { 2, 24, 4 },
+    [HACKRF_ADF4158_CLK1_DIVIDER] = { 2, 3, 12 },
+    [HACKRF_ADF4158_RESERVED3] = { 2, 23, 1 },
+    [HACKRF_ADF4158_RESERVED2] = { 2, 29, 3 },
+    [HACKRF_ADF4158_POWER_DOWN] = { 3, 5, 1 },
+    [HACKRF_ADF4158_PSK_ENABLE] = { 3, 9, 1 },
+    [HACKRF_ADF4158_FSK_ENABLE] = { 3, 8, 1 },
+    [HACKRF_ADF4158_SD_RESET] = { 3, 14, 1 },
+    [HACKRF_ADF4158_COUNTER_RESET] = { 3, 3, 1 },
+    [HACKRF_ADF4158_RESERVED5] = { 3, 12, 2 },
+    [HACKRF_ADF4158_RESERVED4] = { 3, 16, 16 },
+    [HACKRF_ADF4158_RAMP_MODE] = { 3, 10, 2 },
+    [HACKRF_ADF4158_N_SEL] = { 3, 15, 1 },
+    [HACKRF_ADF4158_CP_3STATE] = { 3, 4, 1 },
+    [HACKRF_ADF4158_LPD] = { 3, 7, 1 },
+    [HACKRF_ADF4158_PD_POLARITY] = { 3, 6, 1 },
+    [HACKRF_ADF4158_NEG_BLEED_CURRENT] = { 4, 23, 2 },
+    [HACKRF_ADF4158_CLK_DIV_MODE] = { 4, 19, 2 },
+    [HACKRF_ADF4158_CLK2_DIVIDER] = { 4, 7, 12 },
+    [HACKRF_ADF4158_SD_MOD_MODE] = { 4, 26, 5 },
+    [HACKRF_ADF4158_RESERVED7] = { 4, 3, 4 },
+    [HACKRF_ADF4158_RESERVED6] = { 4, 25, 1 },
+    [HACKRF_ADF4158_LF_SEL] = { 4, 31, 1 },
+    [HACKRF_ADF4158_READBACK_TO_MUXOUT] = { 4, 21, 2 },
+    [HACKRF_ADF4158_FSK_RAMP_EN] = { 5, 25, 1 },
+    [HACKRF_ADF4158_TX_RAMP_CLK] = { 5, 29, 1 },
+    [HACKRF_ADF4158_DEV_OFFSET] = { 5, 19, 4 },
+    [HACKRF_ADF4158_PAR_RAMP] = { 5, 28, 1 },
+    [HACKRF_ADF4158_RESERVED8] = { 5, 30, 2 },
+    [HACKRF_ADF4158_DEV_SEL] = { 5, 23, 1 },
+    [HACKRF_ADF4158_INTERRUPT] = { 5, 26, 2 },
+    [HACKRF_ADF4158_RAMP2_EN] = { 5, 24, 1 },
+    [HACKRF_ADF4158_DEVIATION] = { 5, 3, 16 },
+    [HACKRF_ADF4158_STEP] = { 6, 3, 20 },
+    [HACKRF_ADF4158_RESERVED9] = { 6, 24, 8 },
+    [HACKRF_ADF4158_STEP_SEL] = { 6, 23, 1 },
+    [HACKRF_ADF4158_RESERVED10] = { 7, 19, 13 },
+    [HACKRF_ADF4158_RAMP_DEL] = { 7, 17, 1 },
+    [HACKRF_ADF4158_RAMP_DEL_FL] = { 7, 18, 1 },
+    [HACKRF_ADF4158_DEL_START_EN] = { 7, 15, 1 },
+    [HACKRF_ADF4158_DELAY_START_DIVIDER] = { 7, 3, 12 },
+    [HACKRF_ADF4158_DEL_CLK_SEL] = { 7, 16, 1 },
 };
 
-static int hackrf_adf4158_reg_to_device(hackrf_device* device, unsigned int reg);
-
-static uint32_t adf4158[8] = {0};
-
 volatile bool do_exit = false;
 
 static const uint16_t hackrf_usb_vid = 0x1d50;
@@ -232,6 +269,13 @@ static int free_transfers(hackrf_device* device)
 		{
 			if( device->transfers[transfer_index] != NULL )
 			{
+#ifndef _WIN32
+				if( device->transfer_options.lock_buffers )
+				{
+					munlock(device->transfers[transfer_index]->buffer, device->buffer_size);
+				}
+#endif
+				free(device->transfers[transfer_index]->buffer);
 				libusb_free_transfer(device->transfers[transfer_index]);
 				device->transfers[transfer_index] = NULL;
 			}
@@ -276,6 +320,14 @@ static int allocate_transfers(hackrf_device* const device)
 			{
 				return HACKRF_ERROR_NO_MEM;
 			}
+#ifndef _WIN32
+			/* Keep the buffers resident so the transfer thread never waits on a page fault */
+			if( device->transfer_options.lock_buffers
+				&& mlock(device->transfers[transfer_index]->buffer, device->buffer_size) != 0 )
+			{
+				return HACKRF_ERROR_NO_MEM;
+			}
+#endif
 		}
 		return HACKRF_SUCCESS;
 	} else {
@@ -585,6 +637,11 @@ static int hackrf_open_setup(libusb_device_handle* usb_device, hackrf_device** d
 	lib_device->transfers = NULL;
 	lib_device->callback = NULL;
 	lib_device->transfer_thread_started = false;
+	lib_device->transfer_options.cpu = -1;
+	lib_device->transfer_options.priority = 0;
+	lib_device->transfer_options.lock_buffers = false;
+	lib_device->transfer_options.private_context = false;
+	lib_device->usb_context = g_libusb_context;
 	/*
 	lib_device->transfer_count = 1024;
 	lib_device->buffer_size = 16384;
@@ -592,11 +649,17 @@ static int hackrf_open_setup(libusb_device_handle* usb_device, hackrf_device** d
 	lib_device->transfer_count = 4*4;
 	lib_device->buffer_size = 262144; /* 1048576; */
 	lib_device->streaming = false;
+	lib_device->stream_format = HACKRF_STREAM_FORMAT_RAW;
+	lib_device->gap_fill = false;
+	memset(&lib_device->gap_stats, 0, sizeof(lib_device->gap_stats));
+	pthread_mutex_init(&lib_device->gap_stats_mutex, NULL);
+	memset(lib_device->adf4158, 0, sizeof(lib_device->adf4158));
 	do_exit = false;
 
 	result = allocate_transfers(lib_device);
 	if( result != 0 )
 	{
+		pthread_mutex_destroy(&lib_device->gap_stats_mutex);
 		free(lib_device);
 		libusb_release_interface(usb_device, 0);
 		libusb_close(usb_device);
@@ -702,27 +765,13 @@ int ADDCALL hackrf_set_transceiver_mode(hackrf_device* device, hackrf_transceive
 	}
 }
 
-int ADDCALL hackrf_set_sweep(hackrf_device* device, double fstart, double bw, double length, int delay) {
-    unsigned int res = 0;
+/* Compute the registers of a sweep into a register image in one pass */
+static int adf4158_sweep(uint32_t* regs, double fstart, double bw, double length, int delay) {
     unsigned int n = fstart/FPD_FREQ;
     unsigned int frac_msb = ((fstart/FPD_FREQ) -n)*(1 <<12);
     unsigned int frac_lsb = ((((fstart/FPD_FREQ) -n)*(1 << 12))-frac_msb)*(1 <<13);
-    res = hackrf_set_adf4158_reg("n", n);
-    res |= hackrf_set_adf4158_reg("frac_msb", frac_msb);
-    res |= hackrf_set_adf4158_reg("frac_lsb", frac_lsb);
-    printf("n: %d\n", n);
-    printf("frac_msb: %d\n", frac_msb);
-    printf("frac_lsb: %d\n", frac_lsb);
-    if (res) {
-        return -1;
-    }
 
     unsigned int clk1 = (FPD_FREQ*length/(1<<20))+1;
-    res |= hackrf_set_adf4158_reg("clk1_divider", clk1);
-    res |= hackrf_set_adf4158_reg("clk2_divider", 1);
-    if (res) {
-        return -1;
-    }
 
     unsigned int steps = FPD_FREQ*length/clk1;
 
@@ -737,122 +786,171 @@ int ADDCALL hackrf_set_sweep(hackrf_device* device, double fstart, double bw, do
 
     unsigned int dev = fdev/(fres*(1 << dev_offset));
 
-    res |= hackrf_set_adf4158_reg("deviation", dev);
-    printf("fres: %f\n", fres);
-    printf("fdev: %f\n", fdev);
-    printf("dev_offset: %d\n", dev_offset);
-    printf("deviation: %d\n", dev);
-
-    res |= hackrf_set_adf4158_reg("step", steps);
-    res |= hackrf_set_adf4158_reg("dev_offset", dev_offset);
-    res |= hackrf_set_adf4158_reg("clk_div_mode", 3); //Ramp clock divider
-    res |= hackrf_set_adf4158_reg("ramp_on", 1); //Enable ramp
-
-    res |= hackrf_set_adf4158_reg("pd_polarity", 1);
-    res |= hackrf_set_adf4158_reg("prescaler", 1);
-    res |= hackrf_set_adf4158_reg("r_counter", 1);
-    res |= hackrf_set_adf4158_reg("csr_en", 1);
-
-    // Readback to muxout and negative bleed current
-    // can't be activated simultaneously
-    if (1) {
-        //Muxout control to readback to muxout
-        res |= hackrf_set_adf4158_reg("muxout", 15);
-        //res |= hackrf_set_adf4158_reg("neg_bleed_current", 0);
-        res |= hackrf_set_adf4158_reg("readback_to_muxout", 3);
-    } else {
-        res |= hackrf_set_adf4158_reg("neg_bleed_current", 3);
+    const hackrf_adf4158_setting settings[] = {
+        { HACKRF_ADF4158_N, n },
+        { HACKRF_ADF4158_FRAC_MSB, frac_msb },
+        { HACKRF_ADF4158_FRAC_LSB, frac_lsb },
+        { HACKRF_ADF4158_CLK1_DIVIDER, clk1 },
+        { HACKRF_ADF4158_CLK2_DIVIDER, 1 },
+        { HACKRF_ADF4158_DEVIATION, dev },
+        { HACKRF_ADF4158_STEP, steps },
+        { HACKRF_ADF4158_DEV_OFFSET, dev_offset },
+        { HACKRF_ADF4158_CLK_DIV_MODE, 3 }, //Ramp clock divider
+        { HACKRF_ADF4158_RAMP_ON, 1 }, //Enable ramp
+
+        { HACKRF_ADF4158_PD_POLARITY, 1 },
+        { HACKRF_ADF4158_PRESCALER, 1 },
+        { HACKRF_ADF4158_R_COUNTER, 1 },
+        { HACKRF_ADF4158_CSR_EN, 1 },
+
+        // Readback to muxout and negative bleed current
+        // can't be activated simultaneously, so muxout
+        // control is set to readback to muxout
+        { HACKRF_ADF4158_MUXOUT, 15 },
+        { HACKRF_ADF4158_READBACK_TO_MUXOUT, 3 },
+
+        { HACKRF_ADF4158_RAMP_MODE, 0 }, //Sawtooth
+    };
+    const hackrf_adf4158_setting delay_settings[] = {
+        { HACKRF_ADF4158_RAMP_DEL_FL, 1 },
+        { HACKRF_ADF4158_RAMP_DEL, 1 },
+        { HACKRF_ADF4158_DELAY_START_DIVIDER, delay },
+    };
+
+    int res = hackrf_adf4158_build(regs, settings, sizeof(settings) / sizeof(settings[0]));
+    if (res == HACKRF_SUCCESS && delay > 0) {
+        res = hackrf_adf4158_build(regs, delay_settings, sizeof(delay_settings) / sizeof(delay_settings[0]));
     }
+    return res;
+}
 
-    res |= hackrf_set_adf4158_reg("ramp_mode", 0); //Sawtooth
-    if (delay > 0) {
-        res |= hackrf_set_adf4158_reg("ramp_del_fl", 1);
-        res |= hackrf_set_adf4158_reg("ramp_del", 1);
-        res |= hackrf_set_adf4158_reg("delay_start_divider", delay);
-    }
+/* The sweep is built in a copy, so an invalid one leaves the device's
+ * register image untouched */
+int ADDCALL hackrf_set_sweep(hackrf_device* device, double fstart, double bw, double length, int delay) {
+    uint32_t regs[HACKRF_ADF4158_REGISTERS];
+    int res;
+
+    memcpy(regs, device->adf4158, sizeof(regs));
+    res = adf4158_sweep(regs, fstart, bw, length, delay);
     if (res) {
         return res;
     }
-    return hackrf_adf4158_to_device(device);
+    return hackrf_set_adf4158_registers(device, regs);
 }
 
-int ADDCALL hackrf_set_adf4158_reg(char *name, unsigned int value) {
-    unsigned int i = 0;
-    while (adf4158_regs[i].name[0]) {
-        if (strcmp(name, adf4158_regs[i].name) == 0) {
-            unsigned int reg = adf4158_regs[i].reg;
-            unsigned int bit = adf4158_regs[i].bit;
-            unsigned int len = adf4158_regs[i].len;
-            adf4158[reg] &= ~((((1 << len)-1)) << bit);
-            adf4158[reg] |= value << bit;
-            return 0;
+/* Apply settings to a register image, values are truncated to their field */
+int ADDCALL hackrf_adf4158_build(uint32_t* regs, const hackrf_adf4158_setting* settings, const unsigned int count) {
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        if ((unsigned int)settings[i].field >= HACKRF_ADF4158_FIELD_COUNT) {
+            return HACKRF_ERROR_INVALID_PARAM;
         }
-        i++;
+        const adf_reg* const r = &adf4158_regs[settings[i].field];
+        const uint32_t mask = (uint32_t)((1ULL << r->len) - 1) << r->bit;
+        regs[r->reg] = (regs[r->reg] & ~mask) | ((settings[i].value << r->bit) & mask);
     }
-    return -1;
+    return HACKRF_SUCCESS;
+}
+
+/* Set one field of the device's register image, sent by hackrf_adf4158_to_device() */
+int ADDCALL hackrf_set_adf4158_field(hackrf_device* device, const enum hackrf_adf4158_field field, const uint32_t value) {
+    const hackrf_adf4158_setting setting = { field, value };
+    return hackrf_adf4158_build(device->adf4158, &setting, 1);
 }
 
-static int hackrf_adf4158_reg_to_device(hackrf_device* device, unsigned int reg)
+/* Send a register image in the data stage of a vendor request */
+static int adf4158_image_to_device(hackrf_device* device, const uint32_t* regs, uint8_t request, uint16_t index)
 {
+    uint32_t image[HACKRF_ADF4158_REGISTERS];
     int result;
-    if (reg > 7) {
-        return -1;
+    int reg;
+
+    for(reg=0;reg<HACKRF_ADF4158_REGISTERS;reg++) {
+        image[reg] = TO_LE((regs[reg] & ~0x7) | reg);
     }
+
     result = libusb_control_transfer(
             device->usb_device,
             LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-            HACKRF_VENDOR_REQUEST_ADF4158_WRITE,
-            adf4158[reg]>>16,
-            (adf4158[reg] & 0xFFF8) | reg,
-            NULL,
+            request,
             0,
+            index,
+            (unsigned char*)image,
+            sizeof(image),
             0
         );
-    return result;
+
+    if( result < (int)sizeof(image) )
+    {
+        return HACKRF_ERROR_LIBUSB;
+    }
+    return HACKRF_SUCCESS;
 }
 
+/* The firmware writes the image in datasheet order, including both
+ * step_sel and dev_sel words, so a sweep is reprogrammed in one transfer.
+ */
 int ADDCALL hackrf_adf4158_to_device(hackrf_device* device)
 {
-    int reg;
+    return adf4158_image_to_device(device, device->adf4158, HACKRF_VENDOR_REQUEST_ADF4158_WRITE_IMAGE, 0);
+}
 
-    int i;
-    for(i=7;i>=0;i--) {
-        printf("%d: %u\n", i, adf4158[i]);
-    }
+/* Replace the device's register image and send it */
+int ADDCALL hackrf_set_adf4158_registers(hackrf_device* device, const uint32_t* regs)
+{
+    memcpy(device->adf4158, regs, sizeof(device->adf4158));
+    return hackrf_adf4158_to_device(device);
+}
 
-    if( hackrf_adf4158_reg_to_device(device, 7) != 0 )
-    {
-        return HACKRF_ERROR_LIBUSB;
-    }
-    hackrf_set_adf4158_reg("step_sel", 0);
-    if( hackrf_adf4158_reg_to_device(device, 6) != 0 )
-    {
-        return HACKRF_ERROR_LIBUSB;
-    }
-    hackrf_set_adf4158_reg("step_sel", 1);
-    if( hackrf_adf4158_reg_to_device(device, 6) != 0 )
+/* Store the registers of a sweep in the firmware table without applying
+ * it. Fields the sweep doesn't set come from the device's register image,
+ * which is left unchanged. */
+int ADDCALL hackrf_load_sweep_profile(hackrf_device* device, const uint8_t profile, double fstart, double bw, double length, int delay)
+{
+    uint32_t regs[HACKRF_ADF4158_REGISTERS];
+    int res;
+
+    if( profile >= HACKRF_SWEEP_PROFILE_COUNT )
     {
-        return HACKRF_ERROR_LIBUSB;
+        return HACKRF_ERROR_INVALID_PARAM;
     }
-    hackrf_set_adf4158_reg("dev_sel", 0);
-    if( hackrf_adf4158_reg_to_device(device, 5) != 0 )
-    {
-        return HACKRF_ERROR_LIBUSB;
+
+    memcpy(regs, device->adf4158, sizeof(regs));
+    res = adf4158_sweep(regs, fstart, bw, length, delay);
+    if (res) {
+        return res;
     }
-    hackrf_set_adf4158_reg("dev_sel", 1);
-    if( hackrf_adf4158_reg_to_device(device, 5) != 0 )
+    return adf4158_image_to_device(device, regs, HACKRF_VENDOR_REQUEST_LOAD_SWEEP_PROFILE, profile);
+}
+
+/* Switch to a loaded profile, then move on to the next loaded profile every
+ * sweeps sweeps, or stay on it when sweeps is 0 */
+int ADDCALL hackrf_select_sweep_profile(hackrf_device* device, const uint8_t profile, const uint16_t sweeps)
+{
+    int result;
+
+    if( profile >= HACKRF_SWEEP_PROFILE_COUNT )
     {
-        return HACKRF_ERROR_LIBUSB;
+        return HACKRF_ERROR_INVALID_PARAM;
     }
 
-    for(reg=4;reg>=0;reg--) {
-        if( hackrf_adf4158_reg_to_device(device, reg) != 0 )
-        {
-            return HACKRF_ERROR_LIBUSB;
-        }
+    result = libusb_control_transfer(
+        device->usb_device,
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+        HACKRF_VENDOR_REQUEST_SELECT_SWEEP_PROFILE,
+        profile,
+        sweeps,
+        NULL,
+        0,
+        0
+    );
+
+    if( result != 0 )
+    {
+        return HACKRF_ERROR_INVALID_PARAM;
+    } else {
+        return HACKRF_SUCCESS;
     }
-
-    return HACKRF_SUCCESS;
 }
 
 int ADDCALL hackrf_set_gpio(hackrf_device *device, uint32_t bits) {
@@ -1058,6 +1156,42 @@ int ADDCALL hackrf_board_partid_serialno_read(hackrf_device* device, read_partid
 	}
 }
 
+/* Fails on firmware without gain control */
+int ADDCALL hackrf_set_gain_control(hackrf_device* device, const hackrf_gain_control* config)
+{
+	hackrf_gain_control data;
+	int result;
+
+	if( config->enable && (config->gain_min > config->gain_max || config->gain_max > 63 || config->step == 0) )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	data = *config;
+	data.clip_level = TO_LE16(data.clip_level);
+	data.clip_limit = TO_LE16(data.clip_limit);
+	data.low_level = TO_LE16(data.low_level);
+	data.hold = TO_LE16(data.hold);
+
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_SET_GAIN_CONTROL,
+		0,
+		0,
+		(unsigned char*)&data,
+		sizeof(data),
+		0
+	);
+
+	if( result < (int)sizeof(data) )
+	{
+		return HACKRF_ERROR_LIBUSB;
+	} else {
+		return HACKRF_SUCCESS;
+	}
+}
+
 int ADDCALL hackrf_set_mcp(hackrf_device* device, uint32_t value)
 {
 	int result;
@@ -1086,6 +1220,295 @@ int ADDCALL hackrf_set_mcp(hackrf_device* device, uint32_t value)
 	}
 }
 
+int ADDCALL hackrf_set_capture_mode(hackrf_device* device, const enum hackrf_capture_mode mode)
+{
+	int result;
+
+	if( mode > HACKRF_CAPTURE_MODE_M0 )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_SET_CAPTURE_MODE,
+		mode,
+		0,
+		NULL,
+		0,
+		0
+	);
+
+	if( result != 0 )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	} else {
+		return HACKRF_SUCCESS;
+	}
+}
+
+int ADDCALL hackrf_set_stream_format(hackrf_device* device, const enum hackrf_stream_format format)
+{
+	int result;
+
+	if( format > HACKRF_STREAM_FORMAT_RANGE )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_SET_STREAM_FORMAT,
+		format,
+		0,
+		NULL,
+		0,
+		0
+	);
+
+	if( result != 0 )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	} else {
+		device->stream_format = format;
+		return HACKRF_SUCCESS;
+	}
+}
+
+int ADDCALL hackrf_set_decimation(hackrf_device* device, const uint8_t factor)
+{
+	int result;
+
+	if( factor == 0 || factor > HACKRF_DECIMATION_MAX || (factor & (factor - 1)) )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_SET_DECIMATION,
+		factor,
+		0,
+		NULL,
+		0,
+		0
+	);
+
+	if( result != 0 )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	} else {
+		return HACKRF_SUCCESS;
+	}
+}
+
+int ADDCALL hackrf_set_range_bins(hackrf_device* device, const uint16_t bins)
+{
+	int result;
+
+	if( bins == 0 || bins > HACKRF_RANGE_BINS_MAX )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_SET_RANGE_BINS,
+		bins,
+		0,
+		NULL,
+		0,
+		0
+	);
+
+	if( result != 0 )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	} else {
+		return HACKRF_SUCCESS;
+	}
+}
+
+int ADDCALL hackrf_set_gap_fill(hackrf_device* device, const uint8_t enable)
+{
+	device->gap_fill = enable ? true : false;
+	return HACKRF_SUCCESS;
+}
+
+int ADDCALL hackrf_get_gap_stats(hackrf_device* device, hackrf_gap_stats* stats)
+{
+	pthread_mutex_lock(&device->gap_stats_mutex);
+	*stats = device->gap_stats;
+	pthread_mutex_unlock(&device->gap_stats_mutex);
+	return HACKRF_SUCCESS;
+}
+
+/* Open the same USB device again in a libusb context of its own */
+static int reopen_in_private_context(hackrf_device* device)
+{
+	libusb_context* context;
+	libusb_device** devices = NULL;
+	libusb_device_handle* usb_device = NULL;
+	libusb_device* current = libusb_get_device(device->usb_device);
+	const uint8_t bus = libusb_get_bus_number(current);
+	const uint8_t address = libusb_get_device_address(current);
+	ssize_t list_length;
+	ssize_t i;
+
+	if( libusb_init(&context) != 0 )
+	{
+		return HACKRF_ERROR_LIBUSB;
+	}
+
+	/* The interface can only be claimed by one handle at a time */
+	libusb_release_interface(device->usb_device, 0);
+
+	list_length = libusb_get_device_list(context, &devices);
+	for( i=0; i<list_length; i++ )
+	{
+		if( libusb_get_bus_number(devices[i]) == bus
+			&& libusb_get_device_address(devices[i]) == address )
+		{
+			if( libusb_open(devices[i], &usb_device) != 0 )
+			{
+				usb_device = NULL;
+			}
+			break;
+		}
+	}
+	if( list_length > 0 )
+	{
+		libusb_free_device_list(devices, 1);
+	}
+
+	if( usb_device == NULL || libusb_claim_interface(usb_device, 0) != LIBUSB_SUCCESS )
+	{
+		if( usb_device != NULL )
+		{
+			libusb_close(usb_device);
+		}
+		libusb_exit(context);
+		libusb_claim_interface(device->usb_device, 0);
+		return HACKRF_ERROR_LIBUSB;
+	}
+
+	libusb_close(device->usb_device);
+	if( device->usb_context != g_libusb_context )
+	{
+		libusb_exit(device->usb_context);
+	}
+	device->usb_device = usb_device;
+	device->usb_context = context;
+	return HACKRF_SUCCESS;
+}
+
+int ADDCALL hackrf_set_transfer_options(hackrf_device* device, const hackrf_transfer_options* options)
+{
+	int result;
+
+	if( device->transfer_thread_started )
+	{
+		return HACKRF_ERROR_BUSY;
+	}
+#ifdef __linux__
+	if( options->cpu >= CPU_SETSIZE )
+#else
+	/* No portable way to pin a thread */
+	if( options->cpu >= 0 )
+#endif
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+#ifdef _WIN32
+	if( options->lock_buffers )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+#endif
+	if( options->priority < 0 || options->priority > sched_get_priority_max(SCHED_FIFO) )
+	{
+		return HACKRF_ERROR_INVALID_PARAM;
+	}
+
+	/* Transfers hold the device handle and lock state of their buffers */
+	free_transfers(device);
+	device->transfer_options = *options;
+
+	result = HACKRF_SUCCESS;
+	if( options->private_context && device->usb_context == g_libusb_context )
+	{
+		result = reopen_in_private_context(device);
+	}
+
+	if( allocate_transfers(device) != HACKRF_SUCCESS )
+	{
+		free_transfers(device);
+		device->transfer_options.lock_buffers = false;
+		allocate_transfers(device);
+		return HACKRF_ERROR_NO_MEM;
+	}
+	return result;
+}
+
+int ADDCALL hackrf_read_overruns(hackrf_device* device, uint32_t* overruns)
+{
+	int result;
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_READ_OVERRUNS,
+		0,
+		0,
+		(unsigned char*)overruns,
+		sizeof(*overruns),
+		0
+	);
+
+	if (result < (int)sizeof(*overruns))
+	{
+		return HACKRF_ERROR_LIBUSB;
+	} else {
+		*overruns = TO_LE(*overruns);
+		return HACKRF_SUCCESS;
+	}
+}
+
+int ADDCALL hackrf_read_stats(hackrf_device* device, hackrf_stats* stats)
+{
+	int result;
+	memset(stats, 0, sizeof(*stats));
+	result = libusb_control_transfer(
+		device->usb_device,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		HACKRF_VENDOR_REQUEST_READ_STATS,
+		0,
+		0,
+		(unsigned char*)stats,
+		sizeof(*stats),
+		0
+	);
+
+	/* Older firmware sends fewer fields, the rest stay zero */
+	if (result < (int)offsetof(hackrf_stats, dma_errors))
+	{
+		return HACKRF_ERROR_LIBUSB;
+	} else {
+		stats->interrupts = TO_LE(stats->interrupts);
+		stats->packets = TO_LE(stats->packets);
+		stats->overruns = TO_LE(stats->overruns);
+		stats->transfers = TO_LE(stats->transfers);
+		stats->sync_edges = TO_LE(stats->sync_edges);
+		stats->isr_cycles_max = TO_LE(stats->isr_cycles_max);
+		stats->isr_interval_max = TO_LE(stats->isr_interval_max);
+		stats->dma_errors = TO_LE(stats->dma_errors);
+		return HACKRF_SUCCESS;
+	}
+}
+
 static void* transfer_threadproc(void* arg)
 {
 	hackrf_device* device = (hackrf_device*)arg;
@@ -1094,7 +1517,7 @@ static void* transfer_threadproc(void* arg)
 
 	while( (device->streaming) && (do_exit == false) )
 	{
-		error = libusb_handle_events_timeout(g_libusb_context, &timeout);
+		error = libusb_handle_events_timeout(device->usb_context, &timeout);
 		if( (error != 0) && (error != LIBUSB_ERROR_INTERRUPTED) )
 		{
 			device->streaming = false;
@@ -1104,22 +1527,156 @@ static void* transfer_threadproc(void* arg)
 	return NULL;
 }
 
+static int deliver_block(hackrf_device* device, uint8_t* buffer, int length)
+{
+	hackrf_transfer transfer = {
+		transfer.device = device,
+		transfer.buffer = buffer,
+		transfer.buffer_length = length,
+		transfer.valid_length = length,
+		transfer.rx_ctx = device->rx_ctx,
+		transfer.tx_ctx = device->tx_ctx
+	};
+
+	return device->callback(&transfer);
+}
+
+/* Pass zeroed segments covering the samples missing from a gap */
+static int deliver_gap_fill(hackrf_device* device, uint32_t first_sample, uint32_t samples, uint32_t sequence)
+{
+	uint8_t segment[HACKRF_STREAM_SEGMENT_SIZE];
+	hackrf_segment_header header;
+	int result;
+
+	const uint32_t max = (device->stream_format == HACKRF_STREAM_FORMAT_RANGE)
+		? GAP_FILL_RANGE_VALUES : GAP_FILL_SAMPLES;
+
+	memset(segment, 0, sizeof(segment));
+	while( samples > 0 )
+	{
+		const uint32_t n = (samples < max) ? samples : max;
+		header.header_size = TO_LE16(sizeof(header));
+		header.format = TO_LE16(device->stream_format);
+		header.samples = TO_LE16(n);
+		header.syncs = 0;
+		header.sequence = TO_LE(sequence);
+		header.first_sample = TO_LE(first_sample);
+		header.profile = TO_LE16(device->segment_profile);
+		header.flags = 0;
+		header.gain_sync = TO_LE16(HACKRF_GAIN_SYNC_NONE);
+		header.gain = device->segment_gain;
+		header.gain_start = device->segment_gain;
+		memcpy(segment, &header, sizeof(header));
+
+		result = deliver_block(device, segment, sizeof(segment));
+		if( result != 0 )
+		{
+			return result;
+		}
+		first_sample += n;
+		samples -= n;
+	}
+	return 0;
+}
+
+/* Check the segment headers of a framed receive transfer for gaps, and
+ * split the transfer around zero-filled segments when gap fill is on.
+ * Segments are a multiple of the USB packet size, so a header never
+ * straddles two transfers.
+ */
+static int deliver_segments(hackrf_device* device, uint8_t* buffer, int length)
+{
+	int start = 0;
+	int offset = 0;
+	int result;
+
+	while( offset < length )
+	{
+		if( device->segment_offset == 0 && length - offset >= (int)sizeof(hackrf_segment_header) )
+		{
+			hackrf_segment_header header;
+			memcpy(&header, &buffer[offset], sizeof(header));
+			const uint32_t sequence = TO_LE(header.sequence);
+			const uint32_t first_sample = TO_LE(header.first_sample);
+
+			if( TO_LE16(header.header_size) < offsetof(hackrf_segment_header, profile) )
+			{
+				/* Firmware without sequence numbers */
+				device->segment_synced = false;
+			} else {
+				const uint32_t lost_segments = sequence - device->next_sequence;
+				const uint32_t lost_samples = first_sample - device->next_sample;
+
+				/* Counters going backwards mean capture was restarted */
+				if( device->segment_synced
+					&& (lost_segments != 0 || lost_samples != 0)
+					&& lost_segments < 0x80000000 && lost_samples < 0x80000000 )
+				{
+					pthread_mutex_lock(&device->gap_stats_mutex);
+					device->gap_stats.gaps++;
+					device->gap_stats.lost_segments += lost_segments;
+					device->gap_stats.lost_samples += lost_samples;
+					pthread_mutex_unlock(&device->gap_stats_mutex);
+
+					if( device->gap_fill )
+					{
+						result = deliver_block(device, &buffer[start], offset - start);
+						if( result == 0 )
+						{
+							result = deliver_gap_fill(device, device->next_sample, lost_samples, sequence);
+						}
+						if( result != 0 )
+						{
+							return result;
+						}
+						start = offset;
+					}
+				}
+
+				device->segment_synced = true;
+				device->next_sequence = sequence + 1;
+				device->next_sample = first_sample + TO_LE16(header.samples);
+				/* Zero-filled segments carry the profile and gain from before the gap */
+				device->segment_profile = (TO_LE16(header.header_size) < offsetof(hackrf_segment_header, flags))
+					? 0 : TO_LE16(header.profile);
+				device->segment_gain = (TO_LE16(header.header_size) < sizeof(header))
+					? 0 : header.gain;
+			}
+		}
+
+		const int remaining = HACKRF_STREAM_SEGMENT_SIZE - device->segment_offset;
+		const int step = (remaining < length - offset) ? remaining : length - offset;
+		offset += step;
+		device->segment_offset = (device->segment_offset + step) % HACKRF_STREAM_SEGMENT_SIZE;
+	}
+
+	return deliver_block(device, &buffer[start], length - start);
+}
+
 static void hackrf_libusb_transfer_callback(struct libusb_transfer* usb_transfer)
 {
 	hackrf_device* device = (hackrf_device*)usb_transfer->user_data;
 
 	if(usb_transfer->status == LIBUSB_TRANSFER_COMPLETED)
 	{
-		hackrf_transfer transfer = {
-			transfer.device = device,
-			transfer.buffer = usb_transfer->buffer,
-			transfer.buffer_length = usb_transfer->length,
-			transfer.valid_length = usb_transfer->actual_length,
-			transfer.rx_ctx = device->rx_ctx,
-			transfer.tx_ctx = device->tx_ctx
-		};
+		int result;
+		if( (usb_transfer->endpoint & LIBUSB_ENDPOINT_IN)
+			&& device->stream_format != HACKRF_STREAM_FORMAT_RAW )
+		{
+			result = deliver_segments(device, usb_transfer->buffer, usb_transfer->actual_length);
+		} else {
+			hackrf_transfer transfer = {
+				transfer.device = device,
+				transfer.buffer = usb_transfer->buffer,
+				transfer.buffer_length = usb_transfer->length,
+				transfer.valid_length = usb_transfer->actual_length,
+				transfer.rx_ctx = device->rx_ctx,
+				transfer.tx_ctx = device->tx_ctx
+			};
+			result = device->callback(&transfer);
+		}
 
-		if( device->callback(&transfer) == 0 )
+		if( result == 0 )
 		{
 			if( libusb_submit_transfer(usb_transfer) < 0)
 			{
@@ -1164,6 +1721,41 @@ static int kill_transfer_thread(hackrf_device* device)
 	return HACKRF_SUCCESS;
 }
 
+/* Thread attributes for the scheduling asked for in the transfer options.
+ * Creating the thread fails without the privileges for SCHED_FIFO. */
+static int set_transfer_thread_attr(hackrf_device* device, pthread_attr_t* attr)
+{
+	int result = 0;
+
+	if( device->transfer_options.priority > 0 )
+	{
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = device->transfer_options.priority;
+		result = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		if( result == 0 )
+		{
+			result = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		}
+		if( result == 0 )
+		{
+			result = pthread_attr_setschedparam(attr, &param);
+		}
+	}
+
+#ifdef __linux__
+	if( result == 0 && device->transfer_options.cpu >= 0 )
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(device->transfer_options.cpu, &cpus);
+		result = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	}
+#endif
+
+	return result;
+}
+
 static int create_transfer_thread(hackrf_device* device,
 									const uint8_t endpoint_address,
 									hackrf_sample_block_cb_fn callback)
@@ -1186,11 +1778,21 @@ static int create_transfer_thread(hackrf_device* device,
 
 		device->streaming = true;
 		device->callback = callback;
-		result = pthread_create(&device->transfer_thread, 0, transfer_threadproc, device);
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		result = set_transfer_thread_attr(device, &attr);
+		if( result == 0 )
+		{
+			result = pthread_create(&device->transfer_thread, &attr, transfer_threadproc, device);
+		}
+		pthread_attr_destroy(&attr);
 		if( result == 0 )
 		{
 			device->transfer_thread_started = true;
 		}else {
+			device->streaming = false;
+			cancel_transfers(device);
 			return HACKRF_ERROR_THREAD;
 		}
 	} else {
@@ -1238,6 +1840,13 @@ int ADDCALL hackrf_start_rx(hackrf_device* device, hackrf_sample_block_cb_fn cal
 	if( result == HACKRF_SUCCESS )
 	{
 		device->rx_ctx = rx_ctx;
+		device->segment_offset = 0;
+		device->segment_synced = false;
+		device->segment_profile = 0;
+		device->segment_gain = 0;
+		pthread_mutex_lock(&device->gap_stats_mutex);
+		memset(&device->gap_stats, 0, sizeof(device->gap_stats));
+		pthread_mutex_unlock(&device->gap_stats_mutex);
 		result = create_transfer_thread(device, endpoint_address, callback);
 	}
 	return result;
@@ -1273,6 +1882,12 @@ int ADDCALL hackrf_close(hackrf_device* device)
 
 		free_transfers(device);
 
+		if( device->usb_context != g_libusb_context )
+		{
+			libusb_exit(device->usb_context);
+		}
+
+		pthread_mutex_destroy(&device->gap_stats_mutex);
 		free(device);
 	}
 
@@ -90,6 +90,202 @@ typedef enum {
 	TRANSCEIVER_MODE_CPLD_UPDATE = 4
 } transceiver_mode_t;
 
+enum hackrf_capture_mode {
+	HACKRF_CAPTURE_MODE_ISR = 0,
+	HACKRF_CAPTURE_MODE_DMA = 1,
+	HACKRF_CAPTURE_MODE_M0 = 2,
+};
+
+enum hackrf_stream_format {
+	HACKRF_STREAM_FORMAT_RAW = 0,
+	HACKRF_STREAM_FORMAT_INT16 = 1,
+	HACKRF_STREAM_FORMAT_PACKED10 = 2,
+	HACKRF_STREAM_FORMAT_RAW40 = 3,
+	HACKRF_STREAM_FORMAT_RANGE = 4,
+};
+
+/* Fields of the ADF4158 registers, set in a driver side register image
+ * before it is sent to the device */
+#define HACKRF_ADF4158_REGISTERS (8)
+
+enum hackrf_adf4158_field {
+	HACKRF_ADF4158_FRAC_MSB = 0,
+	HACKRF_ADF4158_N = 1,
+	HACKRF_ADF4158_MUXOUT = 2,
+	HACKRF_ADF4158_RAMP_ON = 3,
+	HACKRF_ADF4158_FRAC_LSB = 4,
+	HACKRF_ADF4158_RESERVED1 = 5,
+	HACKRF_ADF4158_RESERVED0 = 6,
+	HACKRF_ADF4158_R_COUNTER = 7,
+	HACKRF_ADF4158_CSR_EN = 8,
+	HACKRF_ADF4158_RDIV2 = 9,
+	HACKRF_ADF4158_PRESCALER = 10,
+	HACKRF_ADF4158_REFERENCE_DOUBLER = 11,
+	HACKRF_ADF4158_CP_CURRENT = 12,
+	HACKRF_ADF4158_CLK1_DIVIDER = 13,
+	HACKRF_ADF4158_RESERVED3 = 14,
+	HACKRF_ADF4158_RESERVED2 = 15,
+	HACKRF_ADF4158_POWER_DOWN = 16,
+	HACKRF_ADF4158_PSK_ENABLE = 17,
+	HACKRF_ADF4158_FSK_ENABLE = 18,
+	HACKRF_ADF4158_SD_RESET = 19,
+	HACKRF_ADF4158_COUNTER_RESET = 20,
+	HACKRF_ADF4158_RESERVED5 = 21,
+	HACKRF_ADF4158_RESERVED4 = 22,
+	HACKRF_ADF4158_RAMP_MODE = 23,
+	HACKRF_ADF4158_N_SEL = 24,
+	HACKRF_ADF4158_CP_3STATE = 25,
+	HACKRF_ADF4158_LPD = 26,
+	HACKRF_ADF4158_PD_POLARITY = 27,
+	HACKRF_ADF4158_NEG_BLEED_CURRENT = 28,
+	HACKRF_ADF4158_CLK_DIV_MODE = 29,
+	HACKRF_ADF4158_CLK2_DIVIDER = 30,
+	HACKRF_ADF4158_SD_MOD_MODE = 31,
+	HACKRF_ADF4158_RESERVED7 = 32,
+	HACKRF_ADF4158_RESERVED6 = 33,
+	HACKRF_ADF4158_LF_SEL = 34,
+	HACKRF_ADF4158_READBACK_TO_MUXOUT = 35,
+	HACKRF_ADF4158_FSK_RAMP_EN = 36,
+	HACKRF_ADF4158_TX_RAMP_CLK = 37,
+	HACKRF_ADF4158_DEV_OFFSET = 38,
+	HACKRF_ADF4158_PAR_RAMP = 39,
+	HACKRF_ADF4158_RESERVED8 = 40,
+	HACKRF_ADF4158_DEV_SEL = 41,
+	HACKRF_ADF4158_INTERRUPT = 42,
+	HACKRF_ADF4158_RAMP2_EN = 43,
+	HACKRF_ADF4158_DEVIATION = 44,
+	HACKRF_ADF4158_STEP = 45,
+	HACKRF_ADF4158_RESERVED9 = 46,
+	HACKRF_ADF4158_STEP_SEL = 47,
+	HACKRF_ADF4158_RESERVED10 = 48,
+	HACKRF_ADF4158_RAMP_DEL = 49,
+	HACKRF_ADF4158_RAMP_DEL_FL = 50,
+	HACKRF_ADF4158_DEL_START_EN = 51,
+	HACKRF_ADF4158_DELAY_START_DIVIDER = 52,
+	HACKRF_ADF4158_DEL_CLK_SEL = 53,
+	HACKRF_ADF4158_FIELD_COUNT
+};
+
+typedef struct {
+	enum hackrf_adf4158_field field;
+	uint32_t value;
+} hackrf_adf4158_setting;
+
+/* Segment header of the framed stream formats. Each 5632 byte segment
+ * starts with the header, samples follow it and the uint16_t sample indices
+ * of falling sync edges are stored backwards from the end.
+ *
+ * sequence counts segments and first_sample counts samples since capture
+ * started, including dropped ones. libhackrf checks both in the receive
+ * stream and can insert zeroed segments over the samples that are missing.
+ *
+ * profile is the sweep profile at the first sample. Sync edge entries hold
+ * the sample index in HACKRF_SYNC_SAMPLE_MASK and the profile of the sweep
+ * starting at the edge above HACKRF_SYNC_PROFILE_SHIFT.
+ *
+ * gain_start and gain are the MCP4022 values at the first sample and at the
+ * end of the segment. When gain control stepped it within the segment, the
+ * new gain applies from sync edge entry gain_sync on and the sweep before
+ * that edge is transitional. At most one step takes effect per segment.
+ * Firmware with shorter headers has none of them.
+ */
+#define HACKRF_STREAM_SEGMENT_SIZE (5632)
+#define HACKRF_SYNC_SAMPLE_MASK (0x1FFF)
+#define HACKRF_SYNC_PROFILE_SHIFT (13)
+/* Segment flags: the external trigger input was high since the last segment */
+#define HACKRF_SEGMENT_TRIGGER (1 << 0)
+#define HACKRF_GAIN_SYNC_NONE (0xFFFF)
+
+typedef struct {
+	uint16_t header_size;
+	uint16_t format;
+	uint16_t samples;
+	uint16_t syncs;
+	uint32_t sequence;
+	uint32_t first_sample;
+	uint16_t profile;
+	uint16_t flags;
+	uint16_t gain_sync;
+	uint8_t gain;
+	uint8_t gain_start;
+} hackrf_segment_header;
+
+/* The firmware holds a table of ADF4158 register sets for sweeps loaded
+ * with hackrf_load_sweep_profile(). hackrf_select_sweep_profile() switches
+ * at the end of a ramp while receiving, and can step through the loaded
+ * profiles every given number of sweeps. The sweep during which registers
+ * are rewritten is still tagged with the previous profile.
+ */
+#define HACKRF_SWEEP_PROFILE_COUNT (8)
+
+/* HACKRF_STREAM_FORMAT_INT16 can be decimated in the device by a power of
+ * two with a third order CIC filter. Decimated samples have 5 fractional
+ * bits, so full scale is 16384 instead of 512.
+ */
+#define HACKRF_DECIMATION_MAX (64)
+
+/* HACKRF_STREAM_FORMAT_RANGE sends float32 magnitudes of the first bins of
+ * a 1024 point FFT of each sweep instead of samples, profiles back to back.
+ * samples and first_sample in the segment headers count float values.
+ */
+#define HACKRF_RANGE_FFT_SIZE (1024)
+#define HACKRF_RANGE_BINS_MAX (HACKRF_RANGE_FFT_SIZE / 2)
+
+/* Discontinuities found in the framed receive stream since hackrf_start_rx() */
+typedef struct {
+	uint32_t gaps;	/* Segments that didn't continue the previous one */
+	uint32_t lost_segments;	/* Segments missing from the sequence */
+	uint64_t lost_samples;	/* Samples missing, zero-filled when enabled */
+} hackrf_gap_stats;
+
+/* Capture telemetry kept by the firmware since RX was last started */
+typedef struct {
+	uint32_t interrupts;	/* Capture interrupts taken */
+	uint32_t packets;	/* SGPIO exchanges seen, including dropped ones */
+	uint32_t overruns;	/* Packets dropped because the USB ring was full */
+	uint32_t transfers;	/* Segments sent over USB */
+	uint32_t sync_edges;	/* Falling sync edges, dropped packets included, or
+				 * HACKRF_STATS_UNAVAILABLE in M0 capture mode */
+	uint32_t isr_cycles_max;	/* Longest capture interrupt, in M4 cycles */
+	uint32_t isr_interval_max;	/* Longest time between capture interrupts, in M4 cycles */
+	uint32_t dma_errors;	/* GPDMA bus errors, zero on firmware without DMA capture */
+} hackrf_stats;
+
+/* Value of a hackrf_stats field the capture mode can't provide */
+#define HACKRF_STATS_UNAVAILABLE (0xFFFFFFFF)
+
+/* Closed loop gain of the framed sample formats (1 - 3), set with
+ * hackrf_set_gain_control() before hackrf_start_rx() and lasting until
+ * receiving stops. At the end of every sweep the firmware steps the MCP4022
+ * down when more than clip_limit samples reached clip_level, or up when the
+ * peak stayed below low_level for hold sweeps in a row. Levels are sample
+ * magnitudes with a full scale of 512. Steps are recorded in the segment
+ * headers.
+ */
+typedef struct {
+	uint8_t enable;
+	uint8_t gain_min;	/* MCP4022 range, 0 - 63 */
+	uint8_t gain_max;
+	uint8_t step;	/* MCP4022 steps per change */
+	uint16_t clip_level;
+	uint16_t clip_limit;	/* Clipped samples a sweep may have */
+	uint16_t low_level;
+	uint16_t hold;
+} hackrf_gain_control;
+
+/* Scheduling of the thread handling USB events for a device while it
+ * streams, set with hackrf_set_transfer_options() before hackrf_start_rx().
+ * A device with a private libusb context has its events handled apart from
+ * other open devices. Pinning to a core is only available on Linux, and
+ * SCHED_FIFO needs the privileges to use it or hackrf_start_rx() fails.
+ */
+typedef struct {
+	int cpu;	/* Core to run the transfer thread on, -1 for any */
+	int priority;	/* SCHED_FIFO priority, 0 for the default scheduler */
+	uint8_t lock_buffers;	/* mlock() the transfer buffers */
+	uint8_t private_context;	/* Reopen the device in a libusb context of its own */
+} hackrf_transfer_options;
+
 typedef struct hackrf_device hackrf_device;
 
 typedef struct {
@@ -157,12 +353,26 @@ extern ADDAPI const char* ADDCALL hackrf_usb_board_id_name(enum hackrf_usb_board
 extern ADDAPI const char* ADDCALL hackrf_filter_path_name(const enum rf_path_filter path);
 
 extern ADDAPI int ADDCALL hackrf_set_sweep(hackrf_device* device, double fstart, double bw, double length, int delay);
-extern ADDAPI int ADDCALL hackrf_set_adf4158_reg(char *name, unsigned int value);
+extern ADDAPI int ADDCALL hackrf_adf4158_build(uint32_t* regs, const hackrf_adf4158_setting* settings, const unsigned int count);
+extern ADDAPI int ADDCALL hackrf_set_adf4158_field(hackrf_device* device, const enum hackrf_adf4158_field field, const uint32_t value);
+extern ADDAPI int ADDCALL hackrf_set_adf4158_registers(hackrf_device* device, const uint32_t* regs);
 extern ADDAPI int ADDCALL hackrf_adf4158_to_device(hackrf_device* device);
+extern ADDAPI int ADDCALL hackrf_load_sweep_profile(hackrf_device* device, const uint8_t profile, double fstart, double bw, double length, int delay);
+extern ADDAPI int ADDCALL hackrf_select_sweep_profile(hackrf_device* device, const uint8_t profile, const uint16_t sweeps);
 extern ADDAPI int ADDCALL hackrf_set_mcp(hackrf_device* device, uint32_t value);
+extern ADDAPI int ADDCALL hackrf_set_gain_control(hackrf_device* device, const hackrf_gain_control* config);
 extern ADDAPI int ADDCALL hackrf_set_gpio(hackrf_device *device, uint32_t bits);
 extern ADDAPI int ADDCALL hackrf_clear_gpio(hackrf_device *device, uint32_t bits);
 extern ADDAPI int ADDCALL hackrf_set_clock_divider(hackrf_device *device, uint16_t divider);
+extern ADDAPI int ADDCALL hackrf_set_capture_mode(hackrf_device* device, const enum hackrf_capture_mode mode);
+extern ADDAPI int ADDCALL hackrf_set_stream_format(hackrf_device* device, const enum hackrf_stream_format format);
+extern ADDAPI int ADDCALL hackrf_read_overruns(hackrf_device* device, uint32_t* overruns);
+extern ADDAPI int ADDCALL hackrf_read_stats(hackrf_device* device, hackrf_stats* stats);
+extern ADDAPI int ADDCALL hackrf_set_decimation(hackrf_device* device, const uint8_t factor);
+extern ADDAPI int ADDCALL hackrf_set_range_bins(hackrf_device* device, const uint16_t bins);
+extern ADDAPI int ADDCALL hackrf_set_gap_fill(hackrf_device* device, const uint8_t enable);
+extern ADDAPI int ADDCALL hackrf_get_gap_stats(hackrf_device* device, hackrf_gap_stats* stats);
+extern ADDAPI int ADDCALL hackrf_set_transfer_options(hackrf_device* device, const hackrf_transfer_options* options);
 
 #ifdef __cplusplus
 } // __cplusplus defined.
@@ -8,6 +8,35 @@
 #define BLOCK 100*1024*1024
 #define PACKET_SIZE 44
 
+// Stream formats, low byte of the header flags
+#define FORMAT_RAW 0
+#define FORMAT_INT16 1
+#define FORMAT_PACKED10 2
+#define FORMAT_RAW40 3
+#define FORMAT_RANGE 4
+#define FORMAT_MASK 0xFF
+
+// Framed formats are sent in segments with a header
+#define SEGMENT_SIZE 5632
+// Sync edges carry the sweep profile in the top bits
+#define SYNC_SAMPLE_MASK 0x1FFF
+
+typedef struct {
+    uint16_t header_size;
+    uint16_t format;
+    uint16_t samples;
+    uint16_t syncs;
+    uint32_t sequence;
+    uint32_t first_sample;
+    uint16_t profile;
+    uint16_t flags;
+    uint16_t gain_sync;
+    uint8_t gain;
+    uint8_t gain_start;
+} segment_header_t;
+
+#define GAIN_SYNC_NONE 0xFFFF
+
 int decimate = 1;
 int filter = 0;
 
@@ -33,6 +62,52 @@ int lcm(int m, int n)
         return m / gcd(m, n) * n;
 }
 
+// Unpack one segment, returns the number of samples. gain is -1 for
+// firmware that doesn't record it, gain_start the gain at the first sample
+// and gain_sync the edge gain took effect at.
+int read_segment(const uint8_t *segment, int16_t *samples, uint16_t *edges, int *edge_count, int *gain_start, int *gain, int *gain_sync) {
+    segment_header_t header;
+    int i;
+    memcpy(&header, segment, sizeof(header));
+    const uint8_t *payload = segment + header.header_size;
+    if (header.format == FORMAT_INT16) {
+        memcpy(samples, payload, 2*header.samples);
+    } else if (header.format == FORMAT_RAW40) {
+        // Raw packets without the sync word
+        for(i=0;i<header.samples;i++) {
+            const uint8_t *packet = payload + (i/31)*40;
+            int j = i%31;
+            int d1 = !!(array_to_32((int8_t*)packet+32) & (1 << j));
+            int d0 = !!(array_to_32((int8_t*)packet+36) & (1 << j));
+            samples[i] = ((int8_t)packet[j]<<2) | (d1 << 1) | d0;
+        }
+    } else {
+        for(i=0;i<header.samples;i++) {
+            int bit = 10*i;
+            uint32_t x = payload[bit/8] | (payload[bit/8+1] << 8);
+            x = (x >> (bit%8)) & 0x3FF;
+            // Sign extend
+            samples[i] = (x & 0x200) ? (int16_t)(x | 0xFC00) : (int16_t)x;
+        }
+    }
+    // Sync edges are stored backwards from the end of the segment
+    for(i=0;i<header.syncs;i++) {
+        memcpy(&edges[i], segment + SEGMENT_SIZE - 2*(i+1), 2);
+        edges[i] &= SYNC_SAMPLE_MASK;
+    }
+    *edge_count = header.syncs;
+    if (header.header_size >= sizeof(header)) {
+        *gain_start = header.gain_start;
+        *gain = header.gain;
+        *gain_sync = (header.gain_sync == GAIN_SYNC_NONE) ? 0 : header.gain_sync;
+    } else {
+        *gain_start = -1;
+        *gain = -1;
+        *gain_sync = 0;
+    }
+    return header.samples;
+}
+
 int conv(const float *taps, int ntaps, const int16_t *signal, int len_signal, int16_t *output) {
     int i,j;
     float x;
@@ -76,6 +151,17 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    // Gain steps as uint32 pairs of the sync edge the gain took effect at,
+    // counted from the start, and the MCP4022 value. The first entry is the
+    // gain at the first sample, written only for firmware that records it.
+    char *gain_file = malloc(strlen(argv[2])+10);
+    if (!gain_file) {
+        printf("malloc failed\n");
+        return -1;
+    }
+    sprintf(gain_file, "%s.gain", argv[2]);
+    FILE *fgain = NULL;
+
     unsigned int block_size = BLOCK - BLOCK%lcm(PACKET_SIZE, lcm(decimate, TAPS_LENGTH));
     printf("Block size: %d\n", block_size);
 
@@ -105,6 +191,8 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    int format = FORMAT_RAW;
+
     //Read header
     {
         int res;
@@ -144,6 +232,19 @@ int main(int argc, char *argv[]) {
             printf("Failed to read header\n");
             return -1;
         }
+        //Flags are the last field, output is always plain samples
+        if (header_size >= 32) {
+            int flags;
+            memcpy(&flags, header+28, 4);
+            format = flags & FORMAT_MASK;
+            flags &= ~FORMAT_MASK;
+            memcpy(header+28, &flags, 4);
+        }
+        printf("Stream format: %d\n", format);
+        if (format == FORMAT_RANGE) {
+            printf("Range profiles are already transformed, nothing to filter\n");
+            return -1;
+        }
         fwrite(magic, 1, 4, fout);
         fwrite(&version, 4, 1, fout);
         fwrite(&header_size, 4, 1, fout);
@@ -158,11 +259,17 @@ int main(int argc, char *argv[]) {
     unsigned int stored = 0;
     unsigned int sample_counter = 0;
     unsigned int last_sync = 0;
+    unsigned int sweeps = 0;
+    int last_gain = -1;
     while (1) {
         unsigned int sync_counter = 0;
         int read = block_size - stored*2;
-        // Read must be aligned to packet size
-        read = read - read%PACKET_SIZE;
+        // Read must be aligned to packet or segment size
+        if (format == FORMAT_RAW) {
+            read = read - read%PACKET_SIZE;
+        } else {
+            read = read - read%SEGMENT_SIZE;
+        }
         if ( !(read_size = fread(block8, 1, read, fin)) ) {
             // EOF
             break;
@@ -171,7 +278,36 @@ int main(int argc, char *argv[]) {
         // Attach the 2 LSB bits to right samples
         int read_samples = 0;
         int sync_phase = 1;
-        for(i=0;i<read_size/PACKET_SIZE;i++) {
+        for(i=0;format != FORMAT_RAW && i<read_size/SEGMENT_SIZE;i++) {
+            uint16_t edges[SEGMENT_SIZE/2];
+            int edge_count;
+            int gain_start, gain, gain_sync;
+            int n = read_segment((uint8_t*)block8+i*SEGMENT_SIZE, block+stored+read_samples, edges, &edge_count, &gain_start, &gain, &gain_sync);
+            if (gain >= 0 && !fgain && !(fgain = fopen(gain_file, "wb"))) {
+                printf("Failed to open gain output file: %s\n", gain_file);
+                return -1;
+            }
+            // The gain at the start of the capture, or one that changed
+            // while segments were lost
+            if (gain >= 0 && gain_start != last_gain) {
+                uint32_t entry[2] = { sweeps, gain_start };
+                fwrite(entry, 4, 2, fgain);
+                last_gain = gain_start;
+            }
+            if (gain >= 0 && gain != last_gain) {
+                uint32_t entry[2] = { sweeps + gain_sync, gain };
+                fwrite(entry, 4, 2, fgain);
+                last_gain = gain;
+            }
+            sweeps += edge_count;
+            for(j=0;j<edge_count;j++) {
+                syncs[sync_counter++] = sample_counter+edges[j]+1-last_sync;
+                last_sync = sample_counter+edges[j]+1;
+            }
+            sample_counter += n;
+            read_samples += n;
+        }
+        for(i=0;format == FORMAT_RAW && i<read_size/PACKET_SIZE;i++) {
             for(j=0;j<31;j++) {
                 sample_counter++;
                 // Store bits as bytes for easier access
@@ -233,5 +369,9 @@ int main(int argc, char *argv[]) {
     fclose(fin);
     fclose(fout);
     fclose(fsync);
+    if (fgain) {
+        fclose(fgain);
+    }
+    free(gain_file);
     return 0;
 }
@@ -4,8 +4,9 @@ import numpy as np
 import matplotlib.pyplot as plt
 import cPickle as pickle
 from scipy import interpolate as interp
-from numpy.fft import fftshift, fft, ifft, ifft2
-from scipy.optimize import curve_fit
+from numpy.fft import fftshift, ifftshift, fft, ifft, fft2, ifft2
+from scipy.optimize import curve_fit, minimize
+from multiprocessing.pool import ThreadPool
 import time
 
 rs = 0
@@ -13,6 +14,16 @@ squint = 2
 interpolate = 1
 taylor_sl = 30
 dynamic_range = 30
+#Autofocus method: 'entropy', 'jacobi', 'lbfgs' or 'pga'
+autofocus = 'entropy'
+lbfgs_iterations = 50
+#Threads and sweeps per task of the jacobi method, None uses all cores
+jacobi_threads = None
+jacobi_block = 16
+jacobi_damping = 0.7
+pga_iterations = 6
+#Fraction of range bins used by PGA
+pga_bins = 0.125
 
 ###
 
@@ -90,61 +101,78 @@ if type(raw_data) == list or raw_data[0].dtype != np.complex128:
     raw_data *= w
     raw_data = np.array(map(hilbert, raw_data))
 
-def sar_entropy(data, fc, bw, tsweep, delta_crange, errors, window=True):
-    focus = np.ones(data.shape, dtype=np.complex)
-    
-    if 1:
-        #t = np.linspace(0,tsweep,len(data[0]))
-        #gamma = bw/tsweep
-        for e in xrange(len(errors)):
-            if e==0:
-                continue
-            p = -2*errors[e]/c
-            focus[e] = np.exp(1j*(-2*np.pi*(fc)*p))
-            #focus[e] = np.exp(1j*(-2*np.pi*(fc+gamma*t)*p))
-    
-    st = data*focus
-    #Zeropad cross-range
+def sar_geometry(shape, fc, bw, delta_crange):
+    """Cross-range zero-padding and Stolt interpolation table for data of
+    given shape.
+
+    Stolt interpolation is linear for every kx row, so the interp1d calls
+    are replaced by precomputed lower indices and weights that are shared
+    by all focusings of the same geometry."""
+    rows = shape[0]
     if squint >= 1:
-        zpad = squint*st.shape[0]
-        zeros = np.zeros((zpad, st.shape[1]), dtype=np.complex)
-        index = int(np.round((zpad - st.shape[0])/2))
-        for i in xrange(st.shape[0]):
-            zeros[index+i] = st[i]
-        st = zeros
-    
-    kx = np.linspace(-np.pi/delta_crange, np.pi/delta_crange, len(st))
-    kr = np.linspace(((4*np.pi/c)*(fc)), ((4*np.pi/c)*(fc+bw)), len(st[0]))
-    
-    #Along the track FFT
-    st = ift(st, ax = 0)
+        rows = squint*shape[0]
+    index = int(np.round((rows - shape[0])/2))
+
+    kx = np.linspace(-np.pi/delta_crange, np.pi/delta_crange, rows)
+    kr = np.linspace(((4*np.pi/c)*(fc)), ((4*np.pi/c)*(fc+bw)), shape[1])
 
     ky0 = (kr[0]**2 - kx[0]**2 )**0.5
     if np.isnan(ky0):
         raise Exception("Ky0 = NaN")
-        
-    ky_even = np.linspace(ky0, kr[-1], st.shape[1])
-    
-    #Stolt interpolation
-    for i in xrange(len(kx)):
+
+    ky_even = np.linspace(ky0, kr[-1], shape[1])
+
+    lo = np.zeros((rows, shape[1]), dtype=np.int)
+    w = np.zeros((rows, shape[1]))
+    valid = np.zeros((rows, shape[1]), dtype=np.bool)
+    for i in xrange(rows):
         ky = np.sqrt(kr**2 - kx[i]**2 )
-        ci = interp.interp1d(ky, st[i,:], fill_value=0, bounds_error=False)
-        st[i,:] = (ci(ky_even))
-    
+        hi = np.clip(np.searchsorted(ky, ky_even), 1, len(ky)-1)
+        lo[i] = hi-1
+        w[i] = (ky_even-ky[lo[i]])/(ky[hi]-ky[lo[i]])
+        valid[i] = (ky_even >= ky[0]) & (ky_even <= ky[-1])
+
+    return index, rows, lo, w, valid
+
+def stolt(st, geometry):
+    """Stolt interpolation of along-track transformed data. Equal to linear
+    interp1d of every row with zero fill."""
+    index, rows, lo, w, valid = geometry
+    i = np.arange(rows)[:,np.newaxis]
+    return np.where(valid, st[i,lo]*(1-w) + st[i,lo+1]*w, 0)
+
+def sar_window(shape):
+    win_x = taylor(shape[1],taylor_sl)
+    win_y = taylor(shape[0],taylor_sl)
+    return np.outer(win_y, win_x)
+
+def focus_phase(fc, errors):
+    """Phase correction of every sweep. First sweep is the reference."""
+    focus = np.exp(1j*4*np.pi*fc*np.array(errors, dtype=np.float)/c)
+    focus[0] = 1
+    return focus
+
+def sar_entropy(data, fc, bw, tsweep, delta_crange, errors, window=True, geometry=None):
+    if geometry is None:
+        geometry = sar_geometry(data.shape, fc, bw, delta_crange)
+    index, rows, lo, w, valid = geometry
+
+    st = data*focus_phase(fc, errors)[:,np.newaxis]
+    #Zeropad cross-range
+    if rows != st.shape[0]:
+        zeros = np.zeros((rows, st.shape[1]), dtype=np.complex)
+        zeros[index:index+st.shape[0]] = st
+        st = zeros
+
+    #Along the track FFT
+    st = ift(st, ax = 0)
+
+    #Stolt interpolation
+    st = stolt(st, geometry)
+
     if window:
-        #Create window
-        win_x = taylor(st.shape[1],taylor_sl)
-        win_x = np.tile(win_x, [st.shape[0],1])
-        
-        win_y = taylor(st.shape[0],taylor_sl)
-        win_y = np.array([win_y]).T
-        win_y = np.tile(win_y, [1,st.shape[1]])
-        
-        win = win_x*win_y
-        
-        #Apply window
-        st *= win
-    
+        st *= sar_window(st.shape)
+
     #Pad Spectrum
     if 0:
         length_x = 2**(int(np.log2(st.shape[1]*interpolate))+1)
@@ -159,51 +187,268 @@ def sar_entropy(data, fc, bw, tsweep, delta_crange, errors, window=True):
 
     return st
 
+def sweep_contribution(data, k, geometry, window=False):
+    """Focused image of sweep k alone without phase correction.
+
+    The image is linear in the data, so changing the error of sweep k
+    changes the image by (exp(j*dphi)-1) times this contribution. Only one
+    row of the zero-padded data is nonzero, so the along-track FFT is an
+    outer product and all kx rows interpolate the same range vector."""
+    index, rows, lo, w, valid = geometry
+    e = np.zeros(rows, dtype=np.complex)
+    e[index+k] = 1
+    u = ift(e)
+    #ift shifts the range axis twice
+    x = fftshift(fftshift(data[k]))
+    st = np.where(valid, x[lo]*(1-w) + x[lo+1]*w, 0)
+    st *= u[:,np.newaxis]
+    if window:
+        st *= sar_window(st.shape)
+    st = ift2(st)
+    st = fftshift(st, 1)
+    return st
+
 def surrogate(x, w, a, p, c):
     return a*np.cos(x+p)+c
 
-def surrogate_min(raw_data, fc, bw, tsweep, delta_crange, iterations=20):
+def surrogate_fit(im, ck, fc):
+    """Error of one sweep that minimizes the entropy surrogate.
+
+    im is the image without the sweep and ck is the sweep's contribution.
+    Returns the error and the surrogate entropy at it."""
     wl = 3e8/fc
     surrogate = lambda x,a,p,c : a*np.cos(4*np.pi*x/wl+p)+c
-    errors = [0]*len(raw_data)
     #Base for curve fitting
     es = np.linspace(0,wl/4,3)
+    n = [entropy(im+np.exp(1j*4*np.pi*fc*e/c)*ck) for e in es]
+    popt, pcov = curve_fit(surrogate, es, n)
+    d = -wl*(popt[1]-np.pi)/(4*np.pi)
+    # Check that point is minimum from second derivative
+    if -popt[0]*np.cos(popt[1]+4*np.pi*d/wl) < 0:
+        d = -wl*(popt[1])/(4*np.pi)
+    p = surrogate(d, *popt)
+    #Wrap phase
+    if 1:
+        s = np.sign(d)
+        d = abs(d)
+        while abs(d) > wl/2:
+            d -= wl/2
+        d *= s
+    assert p - surrogate(d, *popt) < 1e-5
+    return d, p
+
+def surrogate_min(raw_data, fc, bw, tsweep, delta_crange, iterations=20):
+    errors = [0]*len(raw_data)
+    phase = lambda e : np.exp(1j*4*np.pi*fc*e/c)
+
+    geometry = sar_geometry(raw_data.shape, fc, bw, delta_crange)
 
     try:
         for i in xrange(iterations):
             print "Iteration",i
-            for k in xrange(len(errors)):
-                n = []
-                for e in es:
-                    errors[k] = e
-                    n.append(entropy(sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False)))
-                popt, pcov = curve_fit(surrogate, es, n)
-                d = -wl*(popt[1]-np.pi)/(4*np.pi)
-                # Check that point is minimum from second derivative
-                if -popt[0]*np.cos(popt[1]+4*np.pi*d/wl) < 0:
-                    d = -wl*(popt[1])/(4*np.pi)
-                p = surrogate(d, *popt)
-                #Wrap phase
-                if 1:
-                    s = np.sign(d)
-                    d = abs(d)
-                    while abs(d) > wl/2:
-                        d -= wl/2
-                    d *= s
-                assert p - surrogate(d, *popt) < 1e-5
+            #Refocus once per iteration so that rounding errors of the
+            #rank-one updates don't accumulate
+            im = sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False, geometry)
+            #First sweep is the phase reference
+            for k in xrange(1, len(errors)):
+                #Only one image is kept, a contribution per sweep wouldn't fit
+                #in memory and costs just one IFFT to recompute
+                ck = sweep_contribution(raw_data, k, geometry)
+                #Image without sweep k
+                im -= phase(errors[k])*ck
+                d, p = surrogate_fit(im, ck, fc)
                 errors[k] = d
+                im += phase(d)*ck
             print "Entropy",p
             print errors
     except KeyboardInterrupt:
         print "Aborting"
     return errors
 
+def surrogate_min_jacobi(raw_data, fc, bw, tsweep, delta_crange, iterations=20,
+        threads=jacobi_threads, block=jacobi_block, damping=jacobi_damping):
+    """Parallel version of surrogate_min.
+
+    Errors of all sweeps are fitted against the same image on a thread
+    pool, block sweeps per task, and then moved damping of the way
+    towards the fitted values. The heavy lifting is done in numpy FFTs
+    and array operations that release the GIL."""
+    wl = 3e8/fc
+    errors = np.zeros(len(raw_data))
+    phase = lambda e : np.exp(1j*4*np.pi*fc*e/c)
+
+    geometry = sar_geometry(raw_data.shape, fc, bw, delta_crange)
+    pool = ThreadPool(threads)
+
+    def fit_block(ks):
+        fit = []
+        for k in ks:
+            ck = sweep_contribution(raw_data, k, geometry)
+            fit.append(surrogate_fit(im - phase(errors[k])*ck, ck, fc)[0])
+        return fit
+
+    #First sweep is the phase reference
+    blocks = [range(k, min(k+block, len(errors))) for k in xrange(1, len(errors), block)]
+
+    try:
+        for i in xrange(iterations):
+            print "Iteration",i
+            im = sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False, geometry)
+            fit = np.array(sum(pool.map(fit_block, blocks), []))
+            #Shortest step modulo wl/2
+            step = (fit - errors[1:] + wl/4) % (wl/2) - wl/4
+            errors[1:] += damping*step
+            print "Entropy",entropy(sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False, geometry))
+            print list(errors)
+    except KeyboardInterrupt:
+        print "Aborting"
+    pool.close()
+    return list(errors)
+
+def sar_adjoint(im, sweeps, geometry, window=False):
+    """Adjoint of the focusing of sar_entropy without the phase correction.
+    Maps an image back to data of sweeps rows."""
+    index, rows, lo, w, valid = geometry
+    st = ifftshift(im, 1)
+    #Adjoint of ift2
+    st = ifftshift(fft2(ifftshift(st)))*st.shape[0]**2/st.size
+    if window:
+        st *= sar_window(st.shape)
+    #Adjoint of the Stolt interpolation
+    st = np.where(valid, st, 0)
+    i = np.arange(rows)[:,np.newaxis]*st.shape[1]
+    t = np.zeros(st.size, dtype=np.complex)
+    for l, wl in ((lo, 1-w), (lo+1, w)):
+        t += np.bincount((i+l).ravel(), (st*wl).real.ravel(), st.size)
+        t += 1j*np.bincount((i+l).ravel(), (st*wl).imag.ravel(), st.size)
+    st = t.reshape(st.shape)
+    #Adjoint of the along the track FFT
+    st = ifftshift(fft(ifftshift(st), axis=0))/rows
+    return st[index:index+sweeps]
+
+def entropy_gradient(data, fc, bw, tsweep, delta_crange, phi, geometry):
+    """Entropy of the image and its gradient with respect to the phase
+    corrections of the sweeps. One focusing and one adjoint pass."""
+    st = data*np.exp(1j*phi)[:,np.newaxis]
+    im = sar_entropy(st, fc, bw, tsweep, delta_crange, [0]*len(data), False, geometry)
+    intensity = np.abs(im)**2
+    E = np.sum(intensity)
+    with np.errstate(divide='ignore', invalid='ignore'):
+        l = np.nan_to_num(np.log2(intensity))
+    H = -np.sum(intensity*l)/E+np.log2(E)
+    #dH/d|im|^2
+    g = (np.log2(E)-H-l)/E
+    a = sar_adjoint(g*im, len(data), geometry)
+    return H, -2*np.imag(np.sum(np.conj(a)*st, axis=1))
+
+def lbfgs_min(raw_data, fc, bw, tsweep, delta_crange, iterations=50):
+    """Minimum entropy autofocus with L-BFGS and analytic gradient.
+    First sweep is the phase reference."""
+    geometry = sar_geometry(raw_data.shape, fc, bw, delta_crange)
+    def f(x):
+        H, grad = entropy_gradient(raw_data, fc, bw, tsweep, delta_crange,
+                np.concatenate(([0], x)), geometry)
+        return H, grad[1:]
+    def callback(x):
+        print "Entropy",f(x)[0]
+    res = minimize(f, np.zeros(len(raw_data)-1), jac=True, method='L-BFGS-B',
+            options={'maxiter':iterations}, callback=callback)
+    print res.message
+    return [0]+list(res.x*c/(4*np.pi*fc))
+
+def pga(raw_data, fc, bw, tsweep, delta_crange, iterations=6):
+    """Stripmap phase gradient autofocus.
+
+    Brightest scatterer of the selected range bins is circularly shifted to
+    the centre and windowed, and the phase gradient of its along-track
+    spectrum is estimated. In stripmap geometry spectrum at kx is formed by
+    the sweeps at u = x0 + r0*tan(asin(kx/kc)), so the gradients of all
+    scatterers are mapped to sweep positions and averaged before
+    integrating."""
+    geometry = sar_geometry(raw_data.shape, fc, bw, delta_crange)
+    index, rows, lo, w, valid = geometry
+    sweeps, samples = raw_data.shape
+
+    kx = np.linspace(-np.pi/delta_crange, np.pi/delta_crange, rows)
+    kr = np.linspace(((4*np.pi/c)*(fc)), ((4*np.pi/c)*(fc+bw)), samples)
+    ky0 = (kr[0]**2 - kx[0]**2 )**0.5
+    #Range of the image columns
+    r = 2*np.pi*np.arange(samples)/(samples*(kr[-1]-ky0)/(samples-1))
+    kc = 4*np.pi*(fc+bw/2)/c
+    tan_t = np.tan(np.arcsin(kx/kc))
+
+    n = np.arange(sweeps)
+    errors = np.zeros(sweeps)
+    width = rows
+    bins = max(1, int(samples*pga_bins))
+
+    for i in xrange(iterations):
+        im = sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False, geometry)
+        a = np.abs(im)**2
+
+        #Range bins with the highest peak to mean ratio
+        peak = np.argmax(a, axis=0)
+        ratio = np.max(a, axis=0)/np.mean(a, axis=0)
+        ratio[r < 4*delta_crange] = 0
+        sel = np.argsort(ratio)[::-1][:bins]
+        x0 = (rows//2 - peak[sel])*delta_crange
+
+        #Circular shift peaks to the centre
+        shift = (np.arange(rows) + peak[sel][:,np.newaxis] - rows//2) % rows
+        g = im[shift, sel[:,np.newaxis]]
+
+        #Window from the -10 dB width of the shifted intensity, never
+        #growing between iterations
+        profile = np.sum(np.abs(g)**2, axis=0)
+        above = np.nonzero(profile > 0.1*np.max(profile))[0]
+        width = max(min(1.5*(2*max(rows//2-above[0], above[-1]-rows//2)+1), width), 8)
+        g *= np.abs(np.arange(rows) - rows//2) <= width/2
+
+        #Phase gradient along kx
+        G = fftshift(fft(fftshift(g, axes=1), axis=1), axes=1)
+        dg = G[:,1:]*np.conj(G[:,:-1])
+
+        #Map to sweep positions
+        u = x0[:,np.newaxis] + r[sel][:,np.newaxis]*tan_t
+        du = np.diff(u, axis=1)
+        k = np.round((u[:,1:]+u[:,:-1])/(2*delta_crange) + (sweeps-1)/2.).astype(np.int)
+        ok = (k >= 0) & (k < sweeps)
+        num = np.zeros(sweeps)
+        den = np.zeros(sweeps)
+        np.add.at(num, k[ok], (np.angle(dg)*np.abs(dg)/du)[ok])
+        np.add.at(den, k[ok], np.abs(dg)[ok])
+        grad = num/np.maximum(den, np.finfo(np.float).tiny)
+
+        #Integrate and remove the linear term that moves the image
+        phi = np.cumsum(grad)*delta_crange
+        slope, intercept = np.polyfit(n, phi, 1)
+        phi -= slope*n+intercept
+
+        errors -= phi*c/(4*np.pi*fc)
+        errors -= errors[0]
+        print "Iteration",i,"window",width
+        print "Entropy",entropy(sar_entropy(raw_data, fc, bw, tsweep, delta_crange, errors, False, geometry))
+    return list(errors)
+
 
 t_start = time.time()
-m = surrogate_min(raw_data, fc, bw, tsweep, delta_crange)
+if autofocus == 'pga':
+    m = pga(raw_data, fc, bw, tsweep, delta_crange, pga_iterations)
+elif autofocus == 'lbfgs':
+    m = lbfgs_min(raw_data, fc, bw, tsweep, delta_crange, lbfgs_iterations)
+elif autofocus == 'jacobi':
+    m = surrogate_min_jacobi(raw_data, fc, bw, tsweep, delta_crange,
+            threads=jacobi_threads, block=jacobi_block, damping=jacobi_damping)
+else:
+    m = surrogate_min(raw_data, fc, bw, tsweep, delta_crange)
 
 print m
 print "Done in", time.time() - t_start, "s"
+
+#Errors for sar_process.py
+with open('sar_errors.p', 'wb') as f:
+    pickle.dump(m, f)
+
 #plt.figure()
 #plt.plot(m)
 
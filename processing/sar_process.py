@@ -88,6 +88,28 @@ def hilbert(x):
     fx[0] = 0 # Zero DC component
     return 2*np.fft.ifft(fx)
 
+def motion_compensation(data, fc, bw, tsweep, dr, r_ref):
+    """Range dependent motion compensation of dechirped sweeps.
+
+    dr(r) returns the range error of every sweep at ranges r as an array
+    of shape (sweeps, len(r)). The error at r_ref is corrected in time
+    domain including the shift of the beat frequency, and the remaining
+    range dependent phase in range compressed domain."""
+    n = data.shape[1]
+    gamma = bw/tsweep
+    t = np.arange(n)*tsweep/n
+    e = dr(np.array([r_ref]))[:,0]
+    data = data*np.exp(1j*4*np.pi*np.outer(e, fc+gamma*t)/c)
+
+    #Range of the FFT bins
+    r = np.abs(np.fft.fftfreq(n, tsweep/n))*c/(2*gamma)
+    residual = dr(r)-e[:,np.newaxis]
+    if np.any(residual):
+        data = np.fft.fft(data, axis=1)
+        data *= np.exp(1j*4*np.pi*fc*residual/c)
+        data = np.fft.ifft(data, axis=1)
+    return data
+
 with open('sar_data.p', 'rb') as f:
     fc, bw, tsweep, data, range0, range1, delta_crange = pickle.load(f)
 
@@ -105,6 +127,22 @@ if type(data) == list or data[0].dtype != np.complex128:
 #Insert here the phase error from autofocusing
 errors = []
 
+#or load the errors saved by sar_autofocus.py
+if 0:
+    with open('sar_errors.p', 'rb') as f:
+        errors = pickle.load(f)
+
+#Cross-track and height deviation of the antenna from a straight track
+#for every sweep, cross-track positive towards the scene
+trajectory = None
+if 0:
+    with open('sar_trajectory.p', 'rb') as f:
+        trajectory = pickle.load(f)
+#Antenna height above the ground
+moco_height = 1.0
+#Reference range of the motion compensation
+moco_range = (range0+range1)/2.
+
 if len(errors) > 0:
     errors = np.array(errors)-min(errors)
     errors = (4*np.pi*fc/c)*errors
@@ -121,12 +159,15 @@ if len(errors) > 0:
         plt.xlabel("Samples")
         plt.ylabel("Motion error [m]")
 
-    if 1:
-        t = np.linspace(0,1e-3,len(data[0]))
-        for d in xrange(len(errors)):
-            gamma = bw/tsweep
-            e = -2*errors[d]/c
-            data[d] *= np.exp(1j*(-2*np.pi*(fc+gamma*t)*e))
+    dr = lambda r : np.tile(errors[:,np.newaxis], (1, len(r)))
+    data = motion_compensation(data, fc, bw, tsweep, dr, moco_range)
+
+if trajectory is not None:
+    y, z = map(np.array, trajectory)
+    def dr(r):
+        ground = np.sqrt(np.maximum(r**2-moco_height**2, 0))
+        return np.sqrt((ground-y[:,np.newaxis])**2+(moco_height+z[:,np.newaxis])**2)-r
+    data = motion_compensation(data, fc, bw, tsweep, dr, moco_range)
 
 raw_extent = [range0, range1, crange0, crange1]
 